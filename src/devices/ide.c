@@ -34,6 +34,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +50,13 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+
+/* Most sectors moved by one command.  The sector count register
+   holds 8 bits. */
+#define MAX_SECTORS_PER_COMMAND 128
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +65,8 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt for READ/WRITE
+                                   MULTIPLE, or 0 if not supported. */
   };
 
 /* An ATA channel (aka controller).
@@ -85,7 +95,8 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t,
+                           block_sector_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -136,6 +147,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
         }
 
       /* Register interrupt handler. */
@@ -281,6 +293,20 @@ identify_ata_device (struct ata_disk *d)
     }
   input_sector (c, id);
 
+  /* Enable READ/WRITE MULTIPLE with the largest block size the
+     disk supports, so that a multi-sector transfer interrupts
+     once per block instead of once per sector. */
+  if ((uint8_t) id[47 * 2] > 1)
+    {
+      select_device_wait (d);
+      outb (reg_nsect (c), id[47 * 2]);
+      issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+      sema_down (&c->completion_wait);
+      wait_while_busy (d);
+      if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+        d->multiple = (uint8_t) id[47 * 2];
+    }
+
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
@@ -347,7 +373,7 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_READ_SECTOR_RETRY);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
@@ -367,7 +393,7 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
   if (!wait_while_busy (d))
     PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -376,24 +402,121 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   lock_release (&c->lock);
 }
 
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Uses
+   READ MULTIPLE if the disk supports it, otherwise a READ SECTOR
+   command that covers all of them.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, block_sector_t cnt,
+                   void *buffer_)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+  int per_irq = d->multiple > 1 ? d->multiple : 1;
+
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      block_sector_t chunk = (cnt < MAX_SECTORS_PER_COMMAND
+                              ? cnt : MAX_SECTORS_PER_COMMAND);
+      block_sector_t done = 0;
+
+      select_sector (d, sec_no, chunk);
+      issue_pio_command (c, (d->multiple > 1 ? CMD_READ_MULTIPLE
+                             : CMD_READ_SECTOR_RETRY));
+      while (done < chunk)
+        {
+          /* The disk interrupts when each block is ready. */
+          int i;
+
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + done);
+          for (i = 0; i < per_irq && done < chunk; i++, done++)
+            input_sector (c, buffer + done * BLOCK_SECTOR_SIZE);
+        }
+
+      sec_no += chunk;
+      cnt -= chunk;
+      buffer += chunk * BLOCK_SECTOR_SIZE;
+    }
+  lock_release (&c->lock);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.  Uses
+   WRITE MULTIPLE if the disk supports it, otherwise a WRITE
+   SECTOR command that covers all of them.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, block_sector_t cnt,
+                    const void *buffer_)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+  int per_irq = d->multiple > 1 ? d->multiple : 1;
+
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      block_sector_t chunk = (cnt < MAX_SECTORS_PER_COMMAND
+                              ? cnt : MAX_SECTORS_PER_COMMAND);
+      block_sector_t done = 0;
+
+      select_sector (d, sec_no, chunk);
+      issue_pio_command (c, (d->multiple > 1 ? CMD_WRITE_MULTIPLE
+                             : CMD_WRITE_SECTOR_RETRY));
+      while (done < chunk)
+        {
+          /* The first block goes out as soon as the disk asks for
+             data, each later one after the disk interrupts. */
+          int i;
+
+          if (done > 0)
+            sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + done);
+          for (i = 0; i < per_irq && done < chunk; i++, done++)
+            output_sector (c, buffer + done * BLOCK_SECTOR_SIZE);
+        }
+      sema_down (&c->completion_wait);
+
+      sec_no += chunk;
+      cnt -= chunk;
+      buffer += chunk * BLOCK_SECTOR_SIZE;
+    }
+  lock_release (&c->lock);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the number CNT of sectors to transfer to the
+   disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, block_sector_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -0,0 +1,109 @@
+/* cachebench.c
+
+   Measures how well the buffer cache keeps a small, randomly
+   read "hot" file while a large file is scanned sequentially at
+   the same time.  Compare the replacement policies by booting
+   with -cp=clock and -cp=2q. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+#define HOT_SECTORS 24          /* Size of the hot file. */
+#define SCAN_SECTORS 512        /* Size of the scanned file. */
+#define HOT_READS 4096          /* Random reads of the hot file. */
+#define SCAN_EVERY 4            /* Hot reads per scan step... */
+#define SCAN_STEP 1024          /* ...which reads this many bytes. */
+
+static char buf[SCAN_STEP];
+
+static int make_file (const char *name, int sectors);
+static void print_ratio (const char *what, unsigned long long hits,
+                         unsigned long long misses);
+
+int
+main (void)
+{
+  struct cache_stats before, after, s0, s1;
+  unsigned long long hot_hits = 0, hot_misses = 0;
+  unsigned scan_pos = 0;
+  int hot_fd, scan_fd;
+  int i;
+
+  hot_fd = make_file ("cachebench.hot", HOT_SECTORS);
+  scan_fd = make_file ("cachebench.scan", SCAN_SECTORS);
+  if (hot_fd < 0 || scan_fd < 0)
+    return EXIT_FAILURE;
+
+  random_init (0);
+  if (!cache_stats (&before))
+    {
+      printf ("cachebench: cache statistics not available\n");
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < HOT_READS; i++)
+    {
+      /* A small record from a random sector of the hot file. */
+      cache_stats (&s0);
+      seek (hot_fd, random_ulong () % HOT_SECTORS * 512);
+      read (hot_fd, buf, 64);
+      cache_stats (&s1);
+      hot_hits += s1.hits - s0.hits;
+      hot_misses += s1.misses - s0.misses;
+
+      /* The scan moves on. */
+      if (i % SCAN_EVERY == SCAN_EVERY - 1)
+        {
+          seek (scan_fd, scan_pos);
+          read (scan_fd, buf, SCAN_STEP);
+          scan_pos = (scan_pos + SCAN_STEP) % (SCAN_SECTORS * 512);
+        }
+    }
+  cache_stats (&after);
+
+  printf ("cachebench: %llu-sector cache\n", after.size);
+  print_ratio ("hot file", hot_hits, hot_misses);
+  print_ratio ("overall", after.hits - before.hits,
+               after.misses - before.misses);
+
+  close (hot_fd);
+  close (scan_fd);
+  remove ("cachebench.hot");
+  remove ("cachebench.scan");
+  return EXIT_SUCCESS;
+}
+
+/* Creates file NAME with SECTORS sectors of data and returns an
+   open file descriptor for it, or -1 on failure. */
+static int
+make_file (const char *name, int sectors)
+{
+  int fd, i;
+
+  if (!create (name, 0) || (fd = open (name)) < 0)
+    {
+      printf ("cachebench: cannot create %s\n", name);
+      return -1;
+    }
+
+  memset (buf, 'x', sizeof buf);
+  for (i = 0; i < sectors * 512 / SCAN_STEP; i++)
+    if (write (fd, buf, SCAN_STEP) != SCAN_STEP)
+      {
+        printf ("cachebench: %s: write failed\n", name);
+        return -1;
+      }
+  return fd;
+}
+
+/* Prints the hit ratio of HITS and MISSES, labelled WHAT. */
+static void
+print_ratio (const char *what, unsigned long long hits,
+             unsigned long long misses)
+{
+  unsigned long long total = hits + misses;
+  printf ("cachebench: %s: %llu hits, %llu misses, %llu%% hit ratio\n",
+          what, hits, misses, total > 0 ? hits * 100 / total : 0);
+}
@@ -0,0 +1,33 @@
+/* cachestat.c
+
+   Prints the kernel's buffer cache statistics. */
+
+#include <stdio.h>
+#include <syscall.h>
+
+int
+main (void)
+{
+  struct cache_stats s;
+
+  if (!cache_stats (&s))
+    {
+      printf ("cachestat: cache statistics not available\n");
+      return EXIT_FAILURE;
+    }
+
+  printf ("size:        %llu sectors\n", s.size);
+  printf ("hits:        %llu\n", s.hits);
+  printf ("misses:      %llu\n", s.misses);
+  if (s.hits + s.misses > 0)
+    printf ("hit ratio:   %llu%%\n", s.hits * 100 / (s.hits + s.misses));
+  printf ("evictions:   %llu\n", s.evictions);
+  printf ("write-backs: %llu\n", s.writebacks);
+  printf ("read-ahead:  %llu issued, %llu used\n",
+          s.read_ahead_issued, s.read_ahead_used);
+  printf ("write-behind: %llu sectors in %llu requests, %llu rounds\n",
+          s.flush_sectors, s.flush_requests, s.flush_rounds);
+  printf ("lock waits:  %llu, %llu ticks\n",
+          s.lock_waits, s.lock_wait_ticks);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+/* du.c
+
+   Prints, for each file named on the command line, its size in
+   bytes and sectors and the number of sectors allocated to it,
+   which is smaller for a file with holes.  This won't work until
+   project 4. */
+
+#include <stdio.h>
+#include <syscall.h>
+
+int
+main (int argc, char *argv[])
+{
+  bool success = true;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      int fd = open (argv[i]);
+      int size, blocks;
+
+      if (fd < 0)
+        {
+          printf ("%s: open failed\n", argv[i]);
+          success = false;
+          continue;
+        }
+      size = filesize (fd);
+      blocks = fileblocks (fd);
+      if (size < 0 || blocks < 0)
+        {
+          printf ("%s: not a file\n", argv[i]);
+          success = false;
+        }
+      else
+        printf ("%s: %d bytes, %d sectors, %d allocated\n",
+                argv[i], size, (size + 511) / 512, blocks);
+      close (fd);
+    }
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+/* iobench.c
+
+   Measures how much file system work several processes get done
+   side by side.  One process scans a large file, which keeps the
+   disk busy, while READERS other processes (4 by default) keep
+   reading a few sectors at the start of the same file, which stay
+   in the buffer cache.  Each reader counts its reads until the
+   scan is over, so the totals show how much the readers were held
+   up behind the scanner's disk reads.  Usage: iobench [READERS] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+#define BIG_SECTORS 1024        /* Size of the scanned file. */
+#define SCAN_PASSES 2           /* Times the scanner reads it. */
+#define HOT_SECTORS 8           /* Sectors the readers keep reading. */
+#define MAX_READERS 16
+
+#define BIG_FILE "iobench.big"
+#define DONE_FILE "iobench.done" /* Written once the scan is over. */
+
+static char buf[4096];
+
+static int scan (void);
+static int read_hot (void);
+
+int
+main (int argc, char *argv[])
+{
+  pid_t readers[MAX_READERS], scanner;
+  long long total = 0;
+  int reader_cnt = 4;
+  int fd, i;
+
+  if (argc > 1 && !strcmp (argv[1], "scan"))
+    return scan ();
+  if (argc > 1 && !strcmp (argv[1], "read"))
+    return read_hot ();
+  if (argc > 1)
+    reader_cnt = atoi (argv[1]);
+  if (reader_cnt < 1 || reader_cnt > MAX_READERS)
+    {
+      printf ("iobench: 1 to %d readers\n", MAX_READERS);
+      return EXIT_FAILURE;
+    }
+
+  /* Set up the files. */
+  remove (BIG_FILE);
+  remove (DONE_FILE);
+  if (!create (BIG_FILE, 0) || !create (DONE_FILE, 0)
+      || (fd = open (BIG_FILE)) < 0)
+    {
+      printf ("iobench: cannot create files\n");
+      return EXIT_FAILURE;
+    }
+  memset (buf, 'x', sizeof buf);
+  for (i = 0; i < BIG_SECTORS * 512 / (int) sizeof buf; i++)
+    if (write (fd, buf, sizeof buf) != sizeof buf)
+      {
+        printf ("iobench: write failed\n");
+        return EXIT_FAILURE;
+      }
+  close (fd);
+
+  /* Start the readers, then the scanner. */
+  for (i = 0; i < reader_cnt; i++)
+    readers[i] = exec ("iobench read");
+  scanner = exec ("iobench scan");
+  if (scanner == PID_ERROR)
+    {
+      /* Stop the readers ourselves. */
+      fd = open (DONE_FILE);
+      write (fd, "x", 1);
+      close (fd);
+    }
+  else
+    wait (scanner);
+
+  for (i = 0; i < reader_cnt; i++)
+    if (readers[i] != PID_ERROR)
+      {
+        int reads = wait (readers[i]);
+        printf ("iobench: reader %d: %d reads\n", i, reads);
+        if (reads > 0)
+          total += reads;
+      }
+  printf ("iobench: %d readers, %lld reads during a %d-sector scan\n",
+          reader_cnt, total, SCAN_PASSES * BIG_SECTORS);
+
+  remove (BIG_FILE);
+  remove (DONE_FILE);
+  return EXIT_SUCCESS;
+}
+
+/* Reads the large file SCAN_PASSES times, then tells the readers
+   to stop. */
+static int
+scan (void)
+{
+  int fd = open (BIG_FILE), done_fd = open (DONE_FILE);
+  int pass;
+
+  for (pass = 0; fd >= 0 && pass < SCAN_PASSES; pass++)
+    {
+      seek (fd, 0);
+      while (read (fd, buf, sizeof buf) > 0)
+        continue;
+    }
+  write (done_fd, "x", 1);
+  return fd >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Reads sectors at the start of the large file until the scan is
+   over, and exits with the number of reads. */
+static int
+read_hot (void)
+{
+  int fd = open (BIG_FILE), done_fd = open (DONE_FILE);
+  int reads = 0;
+
+  if (fd < 0 || done_fd < 0)
+    return -1;
+  while (filesize (done_fd) == 0)
+    {
+      seek (fd, reads % HOT_SECTORS * 512);
+      read (fd, buf, 512);
+      reads++;
+    }
+  return reads;
+}
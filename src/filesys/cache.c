@@ -1,139 +1,887 @@
 #include "filesys/cache.h"
+#include "devices/timer.h"
 #include "filesys/filesys.h"
-#include "threads/malloc.h"
+#include "threads/init.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
-#include <list.h>
+#include "threads/vaddr.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
 #include <string.h>
 
-/* Buffer cache. */
-static struct cache_entry cache[BUFFER_CACHE_SIZE];
+/* Buffer cache, CACHE_SIZE entries allocated by cache_init().
+   A CACHE_SIZE of 0 before then means size it from RAM. */
+static struct cache_entry *cache;
+static size_t cache_size;
+
+/* Sector index over the valid entries of CACHE.
+   Protected by cache_lock. */
+static struct hash cache_map;
 
 /* A global lock for sync. */
 static struct lock cache_lock;
 
-/* Read-ahead variables. */
-struct list read_ahead_list;
-struct semaphore read_ahead_sema;
-struct read_ahead_entry {
-  struct list_elem elem; // The list element
-  block_sector_t sector; // Sector id
+/* Replacement state, protected by cache_lock.
+
+   Invalid entries wait on FREE_LIST.  Under CACHE_CLOCK every
+   valid entry is in PROTECTED_QUEUE, which a clock sweeps.
+
+   Under CACHE_2Q a newly cached sector starts on PROBATION_QUEUE,
+   a FIFO holding at most 1/PROBATION_SHARE of the cache.  When it
+   falls off the end its sector is remembered as a ghost.  Only a
+   sector that is missed again while it still has a ghost, or one
+   holding metadata, enters the protected queue, so a large scan
+   cycles through probation without touching the hot set. */
+static enum cache_policy cache_policy = CACHE_2Q;
+static struct list free_list;
+static struct list probation_queue;
+static struct list protected_queue;
+static size_t probation_cnt, protected_cnt;
+
+#define PROBATION_SHARE 4 // probation holds up to 1/4 of the cache
+#define GHOST_SHARE 2     // ghosts remember 1/2 as many sectors
+
+/* A sector recently evicted from probation. */
+struct ghost {
+  struct hash_elem elem;      // element in ghost_map
+  struct list_elem list_elem; // in ghost_fifo or ghost_free
+  block_sector_t sector;
 };
 
-static void read_ahead_add(block_sector_t sector);
+static struct ghost *ghosts;
+static struct hash ghost_map;
+static struct list ghost_fifo, ghost_free;
+
+/* Signalled when an entry becomes idle, for evictions that found
+   every entry in use. */
+static struct condition cache_idle;
+
+/* Read-ahead requests, a ring of sectors waiting for the
+   read-ahead daemon.  Protected by cache_lock; read_ahead_sema
+   counts the queued requests. */
+#define READ_AHEAD_QUEUE_SIZE 64
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head, read_ahead_cnt;
+static struct semaphore read_ahead_sema;
+
+/* Consecutive sectors moved by one multi-sector request of the
+   daemons, staged through a page of their own. */
+#define BATCH_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+static uint8_t *read_ahead_staging;
+static uint8_t *flush_staging;
+
+static thread_func read_ahead_daemon;
+
+/* Write-behind state.  DIRTY_CNT is protected by cache_lock. */
+#define FLUSH_PERIOD_MS 50 // how often the flusher looks at the cache
+static size_t dirty_cnt;
+static int64_t flush_age = FLUSH_DEFAULT_AGE_MS * TIMER_FREQ / 1000;
+
+/* Journal state, protected by cache_lock.  While the journal is
+   on, every write of metadata tags its entry with RUNNING_TXN, the
+   transaction the journal will commit next, and the entry must
+   not reach its home sector before that transaction is in the
+   log, that is, while its TXN is above COMMITTED_TXN.  RUNNING_CNT
+   counts the entries of the running transaction.  A RUNNING_TXN of
+   0 turns all of this off.  STOLEN lists the sectors written back
+   before their commit anyway, see cache_evict(); a STOLEN_CNT above
+   CACHE_STOLEN_MAX means some were not listed. */
+static uint32_t running_txn, committed_txn;
+static size_t running_cnt;
+static block_sector_t stolen[CACHE_STOLEN_MAX];
+static size_t stolen_cnt;
+
+/* Statistics, protected by cache_lock. */
+static struct cache_stats stats;
+
+/* The flusher's batch, CACHE_SIZE entries sorted by sector. */
+static struct cache_entry **flush_batch;
+
+static thread_func flush_daemon;
+
+/* Called by flush_daemon() before each round, see
+   cache_set_flush_hook(). */
+static void (*flush_hook)(int64_t age);
+
+/* Acquires cache_lock, accounting for the time spent waiting
+   for it. */
+static void cache_lock_acquire(void) {
+  if (lock_try_acquire(&cache_lock))
+    return;
+
+  int64_t start = timer_ticks();
+  lock_acquire(&cache_lock);
+  stats.lock_waits++;
+  stats.lock_wait_ticks += timer_elapsed(start);
+}
+
+/* Hash func for the sector index. */
+static unsigned cache_hash(const struct hash_elem *e_, void *aux UNUSED) {
+  const struct cache_entry *e = hash_entry(e_, struct cache_entry, elem);
+  return hash_int(e->disk_sector);
+}
+
+/* Hash less func for the sector index. */
+static bool cache_less(const struct hash_elem *a_, const struct hash_elem *b_,
+                       void *aux UNUSED) {
+  const struct cache_entry *a = hash_entry(a_, struct cache_entry, elem);
+  const struct cache_entry *b = hash_entry(b_, struct cache_entry, elem);
+  return a->disk_sector < b->disk_sector;
+}
+
+/* Hash func for the ghost index. */
+static unsigned ghost_hash(const struct hash_elem *e_, void *aux UNUSED) {
+  const struct ghost *g = hash_entry(e_, struct ghost, elem);
+  return hash_int(g->sector);
+}
+
+/* Hash less func for the ghost index. */
+static bool ghost_less(const struct hash_elem *a_, const struct hash_elem *b_,
+                       void *aux UNUSED) {
+  const struct ghost *a = hash_entry(a_, struct ghost, elem);
+  const struct ghost *b = hash_entry(b_, struct ghost, elem);
+  return a->sector < b->sector;
+}
+
+/* Allocates PAGE_CNT contiguous kernel pages for the cache. */
+static void *cache_alloc(size_t page_cnt) {
+  void *pages = palloc_get_multiple(0, page_cnt);
+  if (pages == NULL)
+    PANIC("buffer cache of %zu sectors does not fit in memory", cache_size);
+  return pages;
+}
 
 /* Initialize the buffer cache. */
 void cache_init(void) {
+  if (cache_size == 0)
+    cache_size = (size_t)init_ram_pages * PGSIZE / BUFFER_CACHE_RAM_SHARE /
+                 BLOCK_SECTOR_SIZE;
+  if (cache_size < BUFFER_CACHE_MIN)
+    cache_size = BUFFER_CACHE_MIN;
+
+  cache = cache_alloc(DIV_ROUND_UP(cache_size * sizeof *cache, PGSIZE));
+  uint8_t *buffers =
+      cache_alloc(DIV_ROUND_UP(cache_size * BLOCK_SECTOR_SIZE, PGSIZE));
+  flush_batch =
+      cache_alloc(DIV_ROUND_UP(cache_size * sizeof *flush_batch, PGSIZE));
+  read_ahead_staging = cache_alloc(1);
+  flush_staging = cache_alloc(1);
+  size_t ghost_cnt = cache_size / GHOST_SHARE;
+  ghosts = cache_alloc(DIV_ROUND_UP(ghost_cnt * sizeof *ghosts, PGSIZE));
+
   lock_init(&cache_lock);
-  for (size_t i = 0; i < BUFFER_CACHE_SIZE; ++i)
+  cond_init(&cache_idle);
+  if (!hash_init(&cache_map, cache_hash, cache_less, NULL) ||
+      !hash_init(&ghost_map, ghost_hash, ghost_less, NULL))
+    PANIC("buffer cache index creation failed");
+
+  list_init(&free_list);
+  list_init(&probation_queue);
+  list_init(&protected_queue);
+  probation_cnt = protected_cnt = 0;
+  list_init(&ghost_fifo);
+  list_init(&ghost_free);
+  for (size_t i = 0; i < ghost_cnt; ++i)
+    list_push_back(&ghost_free, &ghosts[i].list_elem);
+
+  for (size_t i = 0; i < cache_size; ++i) {
+    list_push_back(&free_list, &cache[i].queue_elem);
+    cache[i].buffer = buffers + i * BLOCK_SECTOR_SIZE;
     cache[i].valid = false;
+    cache[i].loading = cache[i].flushing = cache[i].writer = false;
+    cache[i].readers = 0;
+    cache[i].txn = 0;
+    cond_init(&cache[i].cond);
+  }
+
+  running_txn = committed_txn = 0;
+  running_cnt = stolen_cnt = 0;
 
+  read_ahead_head = read_ahead_cnt = 0;
   sema_init(&read_ahead_sema, 0);
-  list_init(&read_ahead_list);
+  thread_create("read-ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+
+  dirty_cnt = 0;
+  thread_create("write-behind", PRI_DEFAULT, flush_daemon, NULL);
+}
+
+/* Sets the number of sectors the cache holds.  Called while
+   parsing the kernel command line, before cache_init(). */
+void cache_set_size(size_t sectors) { cache_size = sectors; }
+
+/* Makes the write-behind daemon call HOOK with the flush age, in
+   timer ticks, before each round, so that data the file system
+   keeps out of the cache for a while reaches it in time. */
+void cache_set_flush_hook(void (*hook)(int64_t age)) { flush_hook = hook; }
+
+/* Returns the number of sectors the cache holds. */
+size_t cache_get_size(void) { return cache_size; }
+
+/* Sets the replacement policy.  Called while parsing the kernel
+   command line, before cache_init(). */
+void cache_set_policy(enum cache_policy policy) { cache_policy = policy; }
+
+/* Sets the age, in milliseconds, at which the write-behind daemon
+   writes back a dirty entry.  Called while parsing the kernel
+   command line, before cache_init(). */
+void cache_set_flush_age(unsigned msec) {
+  flush_age = (int64_t)msec * TIMER_FREQ / 1000;
+}
+
+/* Returns whether anyone is using ENTRY right now. */
+static bool entry_busy(const struct cache_entry *entry) {
+  return entry->loading || entry->flushing || entry->writer ||
+         entry->readers > 0;
+}
+
+/* Returns whether ENTRY holds changes that the journal has not
+   committed yet, which must not be written back. */
+static bool entry_pinned(const struct cache_entry *entry) {
+  return entry->dirty && entry->txn > committed_txn;
+}
+
+/* Returns whether ENTRY can be evicted right now.  Unless STEAL,
+   entries that must not be written back cannot. */
+static bool entry_evictable(const struct cache_entry *entry, bool steal) {
+  return !entry_busy(entry) && (steal || !entry_pinned(entry));
 }
 
-/* Write back a dirty cache entry to disk. */
-static void write_back(struct cache_entry *entry) {
-  if (entry->dirty) {
+/* Wakes up everybody waiting for ENTRY to change state. */
+static void entry_wake(struct cache_entry *entry) {
+  cond_broadcast(&entry->cond, &cache_lock);
+  if (!entry_busy(entry))
+    cond_broadcast(&cache_idle, &cache_lock);
+}
+
+/* Write back a dirty cache entry to disk, unless the journal
+   holds it back and not STEAL.
+   Must be called with cache_lock held, which is dropped during
+   the disk write.  Readers may keep using ENTRY meanwhile. */
+static void write_back(struct cache_entry *entry, bool steal) {
+  ASSERT(lock_held_by_current_thread(&cache_lock));
+
+  while (entry->loading || entry->flushing || entry->writer)
+    cond_wait(&entry->cond, &cache_lock);
+
+  if (entry->valid && entry->dirty && (steal || !entry_pinned(entry))) {
+    if (entry_pinned(entry)) {
+      if (stolen_cnt < CACHE_STOLEN_MAX)
+        stolen[stolen_cnt] = entry->disk_sector;
+      stolen_cnt++;
+    }
+    entry->flushing = true;
+    lock_release(&cache_lock);
+
     block_write(fs_device, entry->disk_sector, entry->buffer);
+
+    cache_lock_acquire();
+    entry->flushing = false;
     entry->dirty = false;
+    dirty_cnt--;
+    stats.writebacks++;
+    entry_wake(entry);
   }
 }
 
+/* Writes back every dirty cache entry that the journal does not
+   hold back. */
+void cache_flush(void) {
+  cache_lock_acquire();
+  for (size_t i = 0; i < cache_size; ++i)
+    if (cache[i].valid)
+      write_back(&cache[i], false);
+  lock_release(&cache_lock);
+}
+
 /* Write back all valid cache entries and close the cache. */
 void cache_close(void) {
-  lock_acquire(&cache_lock);
+  cache_lock_acquire();
 
-  for (size_t i = 0; i < BUFFER_CACHE_SIZE; ++i)
+  for (size_t i = 0; i < cache_size; ++i)
     if (cache[i].valid)
-      write_back(&cache[i]);
+      write_back(&cache[i], true);
 
-  while (!list_empty(&read_ahead_list)) {
-    struct list_elem *e = list_pop_front(&read_ahead_list);
-    struct read_ahead_entry *top = list_entry(e, struct read_ahead_entry, elem);
-    free(top);
-  }
+  // Pending read-ahead is of no use any more.
+  read_ahead_cnt = 0;
 
   lock_release(&cache_lock);
 }
 
 /* Find a cache entry by disk sector. */
 static struct cache_entry *find_cache(block_sector_t sector) {
-  for (size_t i = 0; i < BUFFER_CACHE_SIZE; ++i)
-    if (cache[i].valid && cache[i].disk_sector == sector)
-      return &cache[i];
+  /* Only the key is looked at; static to keep the sector buffer
+     off the stack.  Guarded by cache_lock like the index itself. */
+  static struct cache_entry key;
+  key.disk_sector = sector;
 
-  return NULL;
+  struct hash_elem *e = hash_find(&cache_map, &key.elem);
+  return e == NULL ? NULL : hash_entry(e, struct cache_entry, elem);
 }
 
-/* Evict a cache entry using the clock algorithm. */
-static struct cache_entry *cache_evict(void) {
-  static size_t clock = 0;
-  while (true) {
-    struct cache_entry *entry = &cache[clock];
-    if (!entry->valid)
+/* Writes back SECTOR if it is cached and dirty, unless the
+   journal holds it back. */
+void cache_flush_sector(block_sector_t sector) {
+  cache_lock_acquire();
+  struct cache_entry *entry = find_cache(sector);
+  if (entry != NULL && entry->valid)
+    write_back(entry, false);
+  lock_release(&cache_lock);
+}
+
+/* Remembers that SECTOR fell off the probation queue, forgetting
+   the oldest ghost if there are too many. */
+static void ghost_add(block_sector_t sector) {
+  struct ghost *g;
+  if (!list_empty(&ghost_free))
+    g = list_entry(list_pop_front(&ghost_free), struct ghost, list_elem);
+  else if (!list_empty(&ghost_fifo)) {
+    g = list_entry(list_pop_front(&ghost_fifo), struct ghost, list_elem);
+    hash_delete(&ghost_map, &g->elem);
+  } else
+    return;
+
+  g->sector = sector;
+  hash_insert(&ghost_map, &g->elem);
+  list_push_back(&ghost_fifo, &g->list_elem);
+}
+
+/* Forgets the ghost of SECTOR.  Returns whether there was one,
+   that is, whether SECTOR was evicted from probation recently. */
+static bool ghost_take(block_sector_t sector) {
+  struct ghost key;
+  key.sector = sector;
+
+  struct hash_elem *e = hash_find(&ghost_map, &key.elem);
+  if (e == NULL)
+    return false;
+
+  struct ghost *g = hash_entry(e, struct ghost, elem);
+  hash_delete(&ghost_map, &g->elem);
+  list_remove(&g->list_elem);
+  list_push_back(&ghost_free, &g->list_elem);
+  return true;
+}
+
+/* Moves ENTRY from probation to the protected queue. */
+static void cache_protect(struct cache_entry *entry) {
+  ASSERT(!entry->protected);
+
+  list_remove(&entry->queue_elem);
+  probation_cnt--;
+  entry->protected = true;
+  list_push_back(&protected_queue, &entry->queue_elem);
+  protected_cnt++;
+}
+
+/* Returns the oldest evictable entry on probation (see
+   entry_evictable() for STEAL), or a null pointer if there is
+   none. */
+static struct cache_entry *probation_victim(bool steal) {
+  struct list_elem *e;
+
+  for (e = list_begin(&probation_queue); e != list_end(&probation_queue);
+       e = list_next(e)) {
+    struct cache_entry *entry = list_entry(e, struct cache_entry, queue_elem);
+    if (entry_evictable(entry, steal))
       return entry;
+  }
+  return NULL;
+}
+
+/* Sweeps the clock over the protected queue and returns the first
+   evictable entry (see entry_evictable() for STEAL) not
+   referenced since the last sweep, or a null pointer if two full
+   turns found none. */
+static struct cache_entry *protected_victim(bool steal) {
+  for (size_t i = 0; i < 2 * protected_cnt; i++) {
+    struct list_elem *e = list_pop_front(&protected_queue);
+    list_push_back(&protected_queue, e);
 
+    struct cache_entry *entry = list_entry(e, struct cache_entry, queue_elem);
+    if (!entry_evictable(entry, steal))
+      continue;
     if (entry->access)
       entry->access = false;
-    else {
-      if (entry->dirty)
-        write_back(entry);
-      entry->valid = false;
+    else
       return entry;
+  }
+  return NULL;
+}
+
+/* Returns an invalid, idle entry, evicting one if none is free.
+   The entry stays on the free list until cache_install().  If
+   every entry is in use, waits for one to become idle.  Dirty
+   victims are written back first, with cache_lock released
+   during the write.  Entries the journal holds back are passed
+   over unless every idle entry is one: the commit that would
+   release them may be waiting for this thread, so one is written
+   back early instead, which a crash before the commit would
+   expose. */
+static struct cache_entry *cache_evict(void) {
+  while (list_empty(&free_list)) {
+    struct cache_entry *victim = NULL;
+    if (probation_cnt > cache_size / PROBATION_SHARE)
+      victim = probation_victim(false);
+    if (victim == NULL)
+      victim = protected_victim(false);
+    if (victim == NULL)
+      victim = probation_victim(false);
+    bool steal = victim == NULL;
+    if (victim == NULL)
+      victim = probation_victim(true);
+    if (victim == NULL)
+      victim = protected_victim(true);
+    if (victim == NULL) {
+      cond_wait(&cache_idle, &cache_lock);
+      continue;
+    }
+
+    if (victim->dirty) {
+      write_back(victim, steal);
+      // Passed over if it got used while the lock was dropped.
+      if (entry_busy(victim) || victim->dirty ||
+          (victim->protected && victim->access))
+        continue;
+    }
+
+    list_remove(&victim->queue_elem);
+    if (victim->protected)
+      protected_cnt--;
+    else {
+      probation_cnt--;
+      if (cache_policy == CACHE_2Q)
+        ghost_add(victim->disk_sector);
     }
-    clock = (clock + 1) % BUFFER_CACHE_SIZE;
+    if (victim->txn == running_txn && running_txn != 0)
+      running_cnt--;
+    hash_delete(&cache_map, &victim->elem);
+    victim->valid = false;
+    list_push_back(&free_list, &victim->queue_elem);
+    stats.evictions++;
   }
+  return list_entry(list_front(&free_list), struct cache_entry, queue_elem);
 }
 
-#define EVICT                                                                  \
-  if (!entry) {                                                                \
-    entry = cache_evict();                                                     \
-    entry->valid = true;                                                       \
-    entry->disk_sector = sector;                                               \
-    entry->dirty = false;                                                      \
-    block_read(fs_device, sector, entry->buffer);                              \
+/* Makes ENTRY, just returned by cache_evict(), cache SECTOR and
+   queues it according to the replacement policy and HINT.
+   Its buffer holds garbage until it is filled or written.
+   The caller must hold cache_lock. */
+static void cache_install(struct cache_entry *entry, block_sector_t sector,
+                          enum cache_hint hint) {
+  entry->valid = true;
+  entry->disk_sector = sector;
+  entry->dirty = false;
+  entry->prefetched = false;
+  entry->txn = 0;
+  hash_insert(&cache_map, &entry->elem);
+
+  list_remove(&entry->queue_elem);
+  bool seen = cache_policy == CACHE_2Q && ghost_take(sector);
+  if (cache_policy == CACHE_CLOCK || seen || hint == CACHE_META) {
+    entry->protected = true;
+    list_push_back(&protected_queue, &entry->queue_elem);
+    protected_cnt++;
+  } else {
+    entry->protected = false;
+    list_push_back(&probation_queue, &entry->queue_elem);
+    probation_cnt++;
   }
+}
 
-/* Read a block from the cache. */
-void cache_read(block_sector_t sector, void *mem) {
-  lock_acquire(&cache_lock);
-  struct cache_entry *entry = find_cache(sector);
-  EVICT
+/* Returns the entry caching SECTOR, registered as a reader, or as
+   the writer if EXCLUSIVE.  On a miss an entry is evicted for
+   SECTOR and, if FILL, read from disk with cache_lock released;
+   otherwise the caller is about to overwrite the whole sector.
+   HINT tells the replacement policy what SECTOR holds.
+   Must be called with cache_lock held. */
+static struct cache_entry *cache_get(block_sector_t sector, bool exclusive,
+                                     bool fill, enum cache_hint hint) {
+  struct cache_entry *entry;
 
-  entry->access = true;
-  memcpy(mem, entry->buffer, BLOCK_SECTOR_SIZE);
+  while (true) {
+    entry = find_cache(sector);
+    if (entry != NULL) {
+      if (entry->loading || entry->writer ||
+          (exclusive && (entry->readers > 0 || entry->flushing))) {
+        // Look it up again afterwards, it may have been recycled.
+        cond_wait(&entry->cond, &cache_lock);
+        continue;
+      }
+      stats.hits++;
+      if (entry->prefetched) {
+        entry->prefetched = false;
+        stats.read_ahead_used++;
+      }
+      if (hint == CACHE_META && !entry->protected)
+        cache_protect(entry);
+      break;
+    }
+
+    entry = cache_evict();
+    if (find_cache(sector) != NULL)
+      continue; // filled by someone else while we were evicting
+
+    stats.misses++;
+    cache_install(entry, sector, hint);
+    if (fill) {
+      entry->loading = true;
+      lock_release(&cache_lock);
+
+      block_read(fs_device, sector, entry->buffer);
+
+      cache_lock_acquire();
+      entry->loading = false;
+      entry_wake(entry);
+    }
+    break;
+  }
 
-  read_ahead_add(sector + 1); // Read ahead for the next sector
+  entry->access = true;
+  if (exclusive)
+    entry->writer = true;
+  else
+    entry->readers++;
+  return entry;
+}
 
+/* Releases ENTRY obtained from cache_get().  HINT tells what was
+   written to it, if EXCLUSIVE; metadata joins the running journal
+   transaction. */
+static void cache_put(struct cache_entry *entry, bool exclusive,
+                      enum cache_hint hint) {
+  cache_lock_acquire();
+  if (exclusive) {
+    entry->writer = false;
+    if (!entry->dirty) {
+      entry->dirty = true;
+      entry->dirty_since = timer_ticks();
+      dirty_cnt++;
+    }
+    if (hint == CACHE_META && running_txn != 0 &&
+        entry->txn != running_txn) {
+      entry->txn = running_txn;
+      running_cnt++;
+    }
+  } else
+    entry->readers--;
+  entry_wake(entry);
   lock_release(&cache_lock);
 }
 
+/* Read a block from the cache. */
+void cache_read(block_sector_t sector, void *mem, enum cache_hint hint) {
+  cache_read_at(sector, 0, BLOCK_SECTOR_SIZE, mem, hint);
+}
+
 /* Write a block to the cache. */
-void cache_write(block_sector_t sector, const void *data) {
-  lock_acquire(&cache_lock);
-  struct cache_entry *entry = find_cache(sector);
-  EVICT
+void cache_write(block_sector_t sector, const void *data,
+                 enum cache_hint hint) {
+  cache_write_at(sector, 0, BLOCK_SECTOR_SIZE, data, hint);
+}
 
-  entry->access = true;
-  entry->dirty = true;
-  memcpy(entry->buffer, data, BLOCK_SECTOR_SIZE);
+/* Copies SIZE bytes starting at byte OFS of SECTOR into MEM. */
+void cache_read_at(block_sector_t sector, off_t ofs, off_t size, void *mem,
+                   enum cache_hint hint) {
+  ASSERT(ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  cache_lock_acquire();
+  struct cache_entry *entry = cache_get(sector, false, true, hint);
   lock_release(&cache_lock);
+
+  memcpy(mem, entry->buffer + ofs, size);
+  cache_put(entry, false, hint);
 }
 
-/* Read ahead wait list addition */
-static void read_ahead_add(block_sector_t sector) {
-  struct read_ahead_entry *e = malloc(sizeof(struct read_ahead_entry));
-  e->sector = sector;
-  list_push_back(&read_ahead_list, &e->elem);
-  sema_up(&read_ahead_sema);
+/* Copies SIZE bytes from DATA into SECTOR starting at byte OFS.
+   The rest of the sector is read from disk first unless DATA
+   covers all of it. */
+void cache_write_at(block_sector_t sector, off_t ofs, off_t size,
+                    const void *data, enum cache_hint hint) {
+  ASSERT(ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  cache_lock_acquire();
+  struct cache_entry *entry =
+      cache_get(sector, true, size < BLOCK_SECTOR_SIZE, hint);
+  lock_release(&cache_lock);
+
+  memcpy(entry->buffer + ofs, data, size);
+  cache_put(entry, true, hint);
 }
 
-/* Read ahead for the next sector. */
+/* Asks the read-ahead daemon to bring SECTOR into the cache.
+   Does nothing if SECTOR is already cached, and drops the request
+   if the queue is full. */
 void read_ahead(block_sector_t sector) {
-  struct cache_entry *entry = find_cache(sector);
-  EVICT
+  cache_lock_acquire();
+  if (find_cache(sector) == NULL && read_ahead_cnt < READ_AHEAD_QUEUE_SIZE) {
+    size_t tail = (read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE;
+    read_ahead_queue[tail] = sector;
+    read_ahead_cnt++;
+    sema_up(&read_ahead_sema);
+  }
+  lock_release(&cache_lock);
+}
 
-  entry->access = true;
-  return;
-}
\ No newline at end of file
+/* Read-ahead daemon: fills the cache with queued sectors so that
+   their disk reads overlap with the work of the thread that asked
+   for them. */
+static void read_ahead_daemon(void *aux UNUSED) {
+  struct cache_entry *batch[BATCH_SECTORS];
+
+  while (true) {
+    sema_down(&read_ahead_sema);
+
+    // Claim entries for a run of consecutive queued sectors that
+    // are not cached yet, so that one request reads all of them.
+    cache_lock_acquire();
+    block_sector_t first = read_ahead_queue[read_ahead_head];
+    size_t cnt = 0;
+    while (cnt < BATCH_SECTORS && read_ahead_cnt > 0 &&
+           read_ahead_queue[read_ahead_head] == first + cnt) {
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+      read_ahead_cnt--;
+      if (find_cache(first + cnt) != NULL)
+        break;
+      struct cache_entry *entry = cache_evict();
+      if (find_cache(first + cnt) != NULL)
+        break;
+      cache_install(entry, first + cnt, CACHE_DATA);
+      entry->loading = true;
+      batch[cnt++] = entry;
+    }
+    lock_release(&cache_lock);
+
+    if (cnt == 1)
+      block_read(fs_device, first, batch[0]->buffer);
+    else if (cnt > 1) {
+      block_read_multiple(fs_device, first, cnt, read_ahead_staging);
+      for (size_t i = 0; i < cnt; i++)
+        memcpy(batch[i]->buffer, read_ahead_staging + i * BLOCK_SECTOR_SIZE,
+               BLOCK_SECTOR_SIZE);
+    }
+
+    cache_lock_acquire();
+    for (size_t i = 0; i < cnt; i++) {
+      batch[i]->loading = false;
+      batch[i]->access = false; // not referenced until someone reads it
+      batch[i]->prefetched = true;
+      entry_wake(batch[i]);
+    }
+    stats.read_ahead_issued += cnt;
+    lock_release(&cache_lock);
+  }
+}
+
+/* Orders cache entries by sector. */
+static bool sector_less(const struct cache_entry *a,
+                        const struct cache_entry *b) {
+  return a->disk_sector < b->disk_sector;
+}
+
+/* Writes back dirty entries in the background.  Every
+   FLUSH_PERIOD_MS it picks the entries dirty for longer than the
+   flush age, or all dirty entries if too much of the cache is
+   dirty, and writes them in sector order, one run of adjacent
+   sectors after another.  Eviction then mostly finds clean
+   victims. */
+static void flush_daemon(void *aux UNUSED) {
+  struct cache_entry **batch = flush_batch;
+
+  while (true) {
+    timer_msleep(FLUSH_PERIOD_MS);
+    if (flush_hook != NULL)
+      flush_hook(flush_age);
+
+    cache_lock_acquire();
+    bool flush_all = dirty_cnt * 100 > cache_size * FLUSH_DIRTY_RATIO;
+    int64_t now = timer_ticks();
+    size_t cnt = 0;
+    for (size_t i = 0; i < cache_size; ++i) {
+      struct cache_entry *entry = &cache[i];
+      if (!entry->valid || !entry->dirty || entry->loading ||
+          entry->flushing || entry->writer || entry_pinned(entry))
+        continue;
+      if (!flush_all && now - entry->dirty_since < flush_age)
+        continue;
+
+      // Insertion sort by sector.
+      entry->flushing = true;
+      size_t j = cnt++;
+      for (; j > 0 && sector_less(entry, batch[j - 1]); j--)
+        batch[j] = batch[j - 1];
+      batch[j] = entry;
+    }
+    lock_release(&cache_lock);
+
+    if (cnt == 0)
+      continue;
+
+    // Readers may use the entries meanwhile, writers wait.  Runs
+    // of adjacent sectors go out as one request.
+    size_t requests = 0;
+    for (size_t i = 0; i < cnt;) {
+      block_sector_t first = batch[i]->disk_sector;
+      size_t n = 1;
+      while (i + n < cnt && n < BATCH_SECTORS &&
+             batch[i + n]->disk_sector == first + n)
+        n++;
+
+      if (n == 1)
+        block_write(fs_device, first, batch[i]->buffer);
+      else {
+        for (size_t k = 0; k < n; k++)
+          memcpy(flush_staging + k * BLOCK_SECTOR_SIZE, batch[i + k]->buffer,
+                 BLOCK_SECTOR_SIZE);
+        block_write_multiple(fs_device, first, n, flush_staging);
+      }
+      requests++;
+      i += n;
+    }
+
+    cache_lock_acquire();
+    for (size_t i = 0; i < cnt; i++) {
+      batch[i]->flushing = false;
+      batch[i]->dirty = false;
+      dirty_cnt--;
+      entry_wake(batch[i]);
+    }
+    stats.flush_rounds++;
+    stats.flush_sectors += cnt;
+    stats.flush_requests += requests;
+    lock_release(&cache_lock);
+  }
+}
+
+/* Turns on tagging of metadata writes for the journal. */
+void cache_journal_start(void) {
+  cache_lock_acquire();
+  committed_txn = 0;
+  running_txn = 1;
+  running_cnt = stolen_cnt = 0;
+  lock_release(&cache_lock);
+}
+
+/* Returns the number of sectors in the running transaction. */
+size_t cache_journal_pending(void) {
+  size_t cnt;
+
+  cache_lock_acquire();
+  cnt = running_cnt;
+  lock_release(&cache_lock);
+  return cnt;
+}
+
+/* Ends the running transaction and starts the next one.  Stores
+   the sector of each entry of the transaction into SECTORS and
+   its contents into BUFFERS, for up to MAX of them, and returns
+   how many there are, which may be more than MAX.  The entries
+   stay held back until cache_journal_commit(). */
+size_t cache_journal_collect(block_sector_t *sectors, void *buffers,
+                             size_t max) {
+  uint8_t *buf = buffers;
+  size_t cnt = 0;
+
+  cache_lock_acquire();
+  for (size_t i = 0; i < cache_size; ++i) {
+    struct cache_entry *entry = &cache[i];
+    if (entry->valid && entry->txn == running_txn && entry->writer) {
+      // Let the write finish, then look at every entry again.
+      cond_wait(&entry->cond, &cache_lock);
+      i = -1;
+    }
+  }
+  for (size_t i = 0; i < cache_size; ++i) {
+    struct cache_entry *entry = &cache[i];
+    if (!entry->valid || entry->txn != running_txn)
+      continue;
+    if (cnt < max) {
+      sectors[cnt] = entry->disk_sector;
+      memcpy(buf + cnt * BLOCK_SECTOR_SIZE, entry->buffer, BLOCK_SECTOR_SIZE);
+    }
+    cnt++;
+  }
+  running_txn++;
+  running_cnt = 0;
+  lock_release(&cache_lock);
+  return cnt;
+}
+
+/* Lets the entries of the last collected transaction be written
+   back. */
+void cache_journal_commit(void) {
+  cache_lock_acquire();
+  committed_txn = running_txn - 1;
+  lock_release(&cache_lock);
+}
+
+/* Stores into SECTORS the sectors written back before their
+   commit since the last call, and returns how many there are, or
+   SIZE_MAX if there were more than fit.  SECTORS must have room
+   for CACHE_STOLEN_MAX. */
+size_t cache_journal_stolen(block_sector_t *sectors) {
+  size_t cnt;
+
+  cache_lock_acquire();
+  cnt = stolen_cnt;
+  if (cnt <= CACHE_STOLEN_MAX)
+    memcpy(sectors, stolen, cnt * sizeof *sectors);
+  else
+    cnt = SIZE_MAX;
+  stolen_cnt = 0;
+  lock_release(&cache_lock);
+  return cnt;
+}
+
+/* Drops the CNT sectors starting at SECTOR, which were just freed,
+   from the running transaction. */
+void cache_journal_forget(block_sector_t sector, size_t cnt) {
+  cache_lock_acquire();
+  for (size_t i = 0; i < cache_size; ++i) {
+    struct cache_entry *entry = &cache[i];
+    if (entry->valid && entry->txn == running_txn && running_txn != 0 &&
+        entry->disk_sector - sector < cnt) {
+      entry->txn = 0;
+      running_cnt--;
+    }
+  }
+  lock_release(&cache_lock);
+}
+
+/* Returns whether the cache holds changes to SECTOR that the
+   journal has not committed yet. */
+bool cache_journal_held(block_sector_t sector) {
+  struct cache_entry *entry;
+  bool held;
+
+  cache_lock_acquire();
+  entry = find_cache(sector);
+  held = entry != NULL && entry->valid && entry_pinned(entry);
+  lock_release(&cache_lock);
+  return held;
+}
+
+/* Copies the buffer cache statistics into *OUT. */
+void cache_get_stats(struct cache_stats *out) {
+  cache_lock_acquire();
+  *out = stats;
+  out->size = cache_size;
+  lock_release(&cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void cache_print_stats(void) {
+  struct cache_stats s;
+
+  cache_get_stats(&s);
+  printf("Cache: %llu sectors, %llu hits, %llu misses, %llu evictions, "
+         "%llu write-backs\n",
+         s.size, s.hits, s.misses, s.evictions, s.writebacks);
+  printf("Cache: %llu read ahead, %llu used; %llu written behind in %llu "
+         "requests over %llu rounds\n",
+         s.read_ahead_issued, s.read_ahead_used, s.flush_sectors,
+         s.flush_requests, s.flush_rounds);
+  printf("Cache: lock contended %llu times, %llu ticks waiting\n",
+         s.lock_waits, s.lock_wait_ticks);
+}
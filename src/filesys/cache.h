@@ -4,23 +4,91 @@
 #include "devices/block.h"
 #include "filesys/filesys.h"
 #include "threads/synch.h"
+#include <cache-stats.h>
+#include <hash.h>
+#include <list.h>
 #include <string.h>
 
-#define BUFFER_CACHE_SIZE 64
+/* The cache takes 1/BUFFER_CACHE_RAM_SHARE of RAM, 64 sectors
+   with the default 4 MB, unless sized with -bc=SECTORS. */
+#define BUFFER_CACHE_RAM_SHARE 128
+#define BUFFER_CACHE_MIN 16
 
+/* Write-behind: dirty entries older than the flush age (1 s by
+   default, see cache_set_flush_age()) are written back in the
+   background, and so is every dirty entry once more than
+   FLUSH_DIRTY_RATIO percent of the cache is dirty. */
+#define FLUSH_DEFAULT_AGE_MS 1000
+#define FLUSH_DIRTY_RATIO 50
+
+/* Replacement policies, chosen at boot with -cp=POLICY. */
+enum cache_policy {
+  CACHE_CLOCK, // one-bit clock over every entry
+  CACHE_2Q     // 2Q, which keeps one-time scans out of the hot set
+};
+
+/* What a sector holds.  Under 2Q, metadata (inodes, indirect
+   blocks, directories and the free map) skips probation and is
+   protected from scans right away. */
+enum cache_hint { CACHE_DATA, CACHE_META };
+
+/* A cached sector.
+
+   The index fields and the state below are protected by the
+   global cache_lock.  The buffer itself is not: a thread copies in
+   or out of it after registering as a reader or the writer, and
+   disk I/O on it runs with cache_lock released while LOADING or
+   FLUSHING tells everybody else to wait on COND. */
 struct cache_entry {
-  bool valid;  // valid bit
-  bool dirty;  // dirty bit
-  bool access; // reference bit
+  struct hash_elem elem;       // element in the sector index
+  struct list_elem queue_elem; // in the free list or a replacement queue
+  bool protected;              // in the protected queue, not on probation
+  bool valid;                  // valid bit
+  bool dirty;                  // dirty bit
+  bool access;                 // reference bit
+  bool prefetched;             // read ahead and not looked up since
+  int64_t dirty_since;         // timer tick of the first unflushed write
+  uint32_t txn;                // journal transaction that last changed it
   block_sector_t disk_sector;
-  uint8_t buffer[BLOCK_SECTOR_SIZE];
+
+  bool loading;          // being read from disk, buffer not usable yet
+  bool flushing;         // being written to disk, buffer must not change
+  int readers;           // threads copying out of the buffer
+  bool writer;           // a thread is copying into the buffer
+  struct condition cond; // signalled when the state above changes
+
+  uint8_t *buffer; // BLOCK_SECTOR_SIZE bytes in a palloc page
 };
 
 /* Buffer Caches. */
 void cache_init(void);
 void cache_close(void);
-void cache_read(block_sector_t, void *);
-void cache_write(block_sector_t, const void *);
+void cache_read(block_sector_t, void *, enum cache_hint);
+void cache_write(block_sector_t, const void *, enum cache_hint);
+void cache_read_at(block_sector_t, off_t ofs, off_t size, void *,
+                   enum cache_hint);
+void cache_write_at(block_sector_t, off_t ofs, off_t size, const void *,
+                    enum cache_hint);
 void read_ahead(block_sector_t sector);
+void cache_flush(void);
+void cache_flush_sector(block_sector_t);
+
+/* Support for the journal, see journal.c. */
+#define CACHE_STOLEN_MAX 32
+void cache_journal_start(void);
+size_t cache_journal_pending(void);
+size_t cache_journal_collect(block_sector_t *, void *buffers, size_t max);
+void cache_journal_commit(void);
+size_t cache_journal_stolen(block_sector_t *);
+void cache_journal_forget(block_sector_t, size_t cnt);
+bool cache_journal_held(block_sector_t);
+
+void cache_set_size(size_t sectors);
+size_t cache_get_size(void);
+void cache_set_flush_hook(void (*hook)(int64_t age));
+void cache_set_policy(enum cache_policy);
+void cache_set_flush_age(unsigned msec);
+void cache_get_stats(struct cache_stats *);
+void cache_print_stats(void);
 
-#endif
\ No newline at end of file
+#endif
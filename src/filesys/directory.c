@@ -1,17 +1,28 @@
 #include "filesys/directory.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
+#include <hash.h>
 #include <limits.h>
 #include <list.h>
 #include <stdio.h>
 #include <string.h>
 
-/* A directory. */
+/* A directory.
+
+   Operations that change a directory, and lookups that fill the
+   dentry cache, hold the directory inode's lock (see inode_lock()),
+   so that they see each other's changes whole.  dir_remove() of a
+   directory also locks the directory it removes, after its
+   parent's. */
 struct dir {
   struct inode *inode; /* Backing store. */
   off_t pos;           /* Current position. */
+  struct inode *index; /* Hash index, opened on first use. */
 };
 
 /* A single directory entry. */
@@ -21,14 +32,265 @@ struct dir_entry {
   bool in_use;                 /* In use or free? */
 };
 
+/* The first entry of a directory, which names no file.
+   Directories written before the other fields existed only have
+   a valid PARENT, which MAGIC tells apart. */
+struct dir_header {
+  block_sector_t parent; /* Sector of the parent's inode. */
+  uint32_t magic;        /* DIR_MAGIC if the fields below are valid. */
+  block_sector_t index;  /* Inode sector of the hash index, 0 if none. */
+  uint32_t free_ofs;     /* No free entry before this offset. */
+  uint32_t entry_cnt;    /* Entries in use. */
+};
+
+/* Identifies a directory header. */
+#define DIR_MAGIC 0x44495248
+
+/* A directory gets a hash index once it has this many entries;
+   smaller ones are searched linearly.  The index maps the hash of
+   each name to the offset of its entry, so a lookup reads one
+   bucket instead of the whole directory.  Entries stay where they
+   are, so dir_readdir() works the same either way. */
+#define INDEX_MIN_ENTRIES 128
+
+/* On-disk hash index, kept in an inode of its own.  Sector 0 of
+   the index holds a struct index_header, sectors 1 to BUCKET_CNT
+   the first sector of each bucket, and the sectors after them the
+   overflow sectors of full buckets. */
+struct index_header {
+  uint32_t magic;      /* INDEX_MAGIC. */
+  uint32_t bucket_cnt; /* Number of buckets. */
+};
+
+/* Identifies an index. */
+#define INDEX_MAGIC 0x44494458
+
+/* Slots in one sector of a bucket. */
+#define INDEX_SLOTS 63
+
+/* One sector of a bucket. */
+struct index_sector {
+  uint32_t next; /* Index sector with more of the bucket, 0 if none. */
+  uint32_t cnt;  /* Slots in use. */
+  struct {
+    uint32_t hash; /* hash_string() of the name. */
+    uint32_t ofs;  /* Offset of the entry in the directory. */
+  } slots[INDEX_SLOTS];
+};
+
+/* A new index has INDEX_MIN_BUCKETS buckets, and gets twice as
+   many once it holds more than INDEX_LOAD entries per bucket. */
+#define INDEX_MIN_BUCKETS 8
+#define INDEX_LOAD (INDEX_SLOTS / 2)
+
+/* A cached lookup of NAME in the directory whose inode is in
+   sector PARENT.  A negative entry remembers that the directory
+   has no file by that name. */
+struct dentry {
+  struct hash_elem elem;      /* Element in dentry_map. */
+  struct list_elem list_elem; /* In dentry_lru or dentry_free. */
+  block_sector_t parent;      /* Sector of the directory's inode. */
+  char name[NAME_MAX + 1];    /* Null terminated file name. */
+  bool present;               /* False for a negative entry. */
+  block_sector_t sector;      /* Inode sector of the file, if PRESENT. */
+};
+
+/* Dentry cache, so that resolving a path does not search the
+   directories along it again and again.  dir_add() and
+   dir_remove() keep it up to date; the least recently used entry
+   makes room for a new one.  Protected by dentry_lock. */
+#define DENTRY_CNT 256
+static struct dentry dentries[DENTRY_CNT];
+static struct hash dentry_map;
+static struct list dentry_lru, dentry_free;
+static struct lock dentry_lock;
+
 static void name_split(const char *path, char *directory, char *filename);
-static bool dir_add_subdir(block_sector_t inode_sector, struct dir_entry e,
-                           struct dir *dir);
+static bool dir_add_subdir(block_sector_t inode_sector, struct dir *dir);
 static bool dir_is_empty(const struct dir *dir);
+static void dir_drop_index(struct dir *dir);
 
 // The first is reserved for the parent
 #define START_POS sizeof(struct dir_entry)
 
+/* Hash function for dentry_map. */
+static unsigned dentry_hash(const struct hash_elem *e, void *aux UNUSED) {
+  const struct dentry *d = hash_entry(e, struct dentry, elem);
+  return hash_int(d->parent) ^ hash_string(d->name);
+}
+
+/* Hash less func for dentry_map. */
+static bool dentry_less(const struct hash_elem *a_, const struct hash_elem *b_,
+                        void *aux UNUSED) {
+  const struct dentry *a = hash_entry(a_, struct dentry, elem);
+  const struct dentry *b = hash_entry(b_, struct dentry, elem);
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp(a->name, b->name) < 0;
+}
+
+/* Initializes the directory module. */
+void dir_init(void) {
+  if (!hash_init(&dentry_map, dentry_hash, dentry_less, NULL))
+    PANIC("dentry cache creation failed");
+  list_init(&dentry_lru);
+  list_init(&dentry_free);
+  lock_init(&dentry_lock);
+  for (size_t i = 0; i < DENTRY_CNT; i++)
+    list_push_back(&dentry_free, &dentries[i].list_elem);
+}
+
+/* Returns the dentry for NAME in the directory in sector PARENT,
+   or a null pointer if there is none.  NAME must fit in a
+   dentry.  The caller must hold dentry_lock. */
+static struct dentry *dentry_find(block_sector_t parent, const char *name) {
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.parent = parent;
+  strlcpy(key.name, name, sizeof key.name);
+  e = hash_find(&dentry_map, &key.elem);
+  return e != NULL ? hash_entry(e, struct dentry, elem) : NULL;
+}
+
+/* Looks up NAME in the directory in sector PARENT in the dentry
+   cache.  On a hit, returns true and sets *PRESENT to whether the
+   directory has such a file and, if it does, *SECTORP to its
+   inode sector.  Returns false on a miss. */
+static bool dentry_get(block_sector_t parent, const char *name, bool *present,
+                       block_sector_t *sectorp) {
+  struct dentry *d;
+
+  if (strlen(name) > NAME_MAX)
+    return false;
+
+  lock_acquire(&dentry_lock);
+  d = dentry_find(parent, name);
+  if (d != NULL) {
+    list_remove(&d->list_elem);
+    list_push_front(&dentry_lru, &d->list_elem);
+    *present = d->present;
+    *sectorp = d->sector;
+  }
+  lock_release(&dentry_lock);
+  return d != NULL;
+}
+
+/* Records in the dentry cache that NAME in the directory in
+   sector PARENT is the file whose inode is in SECTOR if PRESENT,
+   or that there is no such file otherwise. */
+static void dentry_put(block_sector_t parent, const char *name, bool present,
+                       block_sector_t sector) {
+  struct dentry *d;
+
+  if (strlen(name) > NAME_MAX)
+    return;
+
+  lock_acquire(&dentry_lock);
+  d = dentry_find(parent, name);
+  if (d != NULL)
+    list_remove(&d->list_elem);
+  else {
+    if (!list_empty(&dentry_free))
+      d = list_entry(list_pop_front(&dentry_free), struct dentry, list_elem);
+    else {
+      d = list_entry(list_pop_back(&dentry_lru), struct dentry, list_elem);
+      hash_delete(&dentry_map, &d->elem);
+    }
+    d->parent = parent;
+    strlcpy(d->name, name, sizeof d->name);
+    hash_insert(&dentry_map, &d->elem);
+  }
+  d->present = present;
+  d->sector = sector;
+  list_push_front(&dentry_lru, &d->list_elem);
+  lock_release(&dentry_lock);
+}
+
+/* Forgets dentry D.  The caller must hold dentry_lock. */
+static void dentry_evict(struct dentry *d) {
+  hash_delete(&dentry_map, &d->elem);
+  list_remove(&d->list_elem);
+  list_push_back(&dentry_free, &d->list_elem);
+}
+
+/* Forgets what the dentry cache knows about NAME in the directory
+   in sector PARENT. */
+static void dentry_drop(block_sector_t parent, const char *name) {
+  struct dentry *d;
+
+  if (strlen(name) > NAME_MAX)
+    return;
+
+  lock_acquire(&dentry_lock);
+  d = dentry_find(parent, name);
+  if (d != NULL)
+    dentry_evict(d);
+  lock_release(&dentry_lock);
+}
+
+/* Forgets every dentry of the directory in sector PARENT, which
+   is being removed, so that none outlives it into a directory
+   that reuses the sector. */
+static void dentry_purge(block_sector_t parent) {
+  struct list_elem *e, *next;
+
+  lock_acquire(&dentry_lock);
+  for (e = list_begin(&dentry_lru); e != list_end(&dentry_lru); e = next) {
+    struct dentry *d = list_entry(e, struct dentry, list_elem);
+    next = list_next(e);
+    if (d->parent == parent)
+      dentry_evict(d);
+  }
+  lock_release(&dentry_lock);
+}
+
+/* Writes a header for a directory with no entries, whose parent
+   is in sector PARENT, to the start of INODE.
+   Returns true if successful, false on failure. */
+static bool header_init(struct inode *inode, block_sector_t parent) {
+  struct dir_header h = {.parent = parent,
+                         .magic = DIR_MAGIC,
+                         .index = 0,
+                         .free_ofs = START_POS,
+                         .entry_cnt = 0};
+
+  ASSERT(sizeof h == sizeof(struct dir_entry));
+  return inode_write_at(inode, &h, sizeof h, 0) == sizeof h;
+}
+
+/* Reads the header of DIR into *H.  The header of a directory
+   written without one is filled in by scanning the entries, and
+   is saved by the next change to the directory. */
+static void header_read(const struct dir *dir, struct dir_header *h) {
+  struct dir_entry e;
+  off_t ofs;
+
+  inode_read_at(dir->inode, h, sizeof *h, 0);
+  if (h->magic == DIR_MAGIC)
+    return;
+
+  h->magic = DIR_MAGIC;
+  h->index = 0;
+  h->free_ofs = 0;
+  h->entry_cnt = 0;
+  for (ofs = START_POS;
+       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use)
+      h->entry_cnt++;
+    else if (h->free_ofs == 0)
+      h->free_ofs = ofs;
+  if (h->free_ofs == 0)
+    h->free_ofs = ofs;
+}
+
+/* Writes *H as the header of DIR.
+   Returns true if successful, false on failure. */
+static bool header_write(struct dir *dir, const struct dir_header *h) {
+  return inode_write_at(dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt) {
@@ -36,15 +298,9 @@ bool dir_create(block_sector_t sector, size_t entry_cnt) {
     return false;
 
   // self-referencing
-  bool success = true;
-  struct dir_entry e;
-  e.inode_sector = sector;
-
-  struct dir *dir = dir_open(inode_open(sector));
-  if (inode_write_at(dir->inode, &e, START_POS, 0) != START_POS)
-    success = false;
-
-  dir_close(dir);
+  struct inode *inode = inode_open(sector);
+  bool success = inode != NULL && header_init(inode, sector);
+  inode_close(inode);
 
   return success;
 }
@@ -79,6 +335,7 @@ struct dir *dir_reopen(struct dir *dir) {
 /* Destroys DIR and frees associated resources. */
 void dir_close(struct dir *dir) {
   if (dir != NULL) {
+    inode_close(dir->index);
     inode_close(dir->inode);
     free(dir);
   }
@@ -87,6 +344,161 @@ void dir_close(struct dir *dir) {
 /* Returns the inode encapsulated by DIR. */
 struct inode *dir_get_inode(struct dir *dir) { return dir->inode; }
 
+/* Returns the index of DIR, whose header is H, opening it if
+   DIR has not opened it yet, or a null pointer if DIR has no
+   index. */
+static struct inode *index_get(const struct dir *dir_,
+                               const struct dir_header *h) {
+  struct dir *dir = (struct dir *)dir_;
+
+  if (h->index == 0)
+    return NULL;
+  if (dir->index != NULL && inode_get_inumber(dir->index) != h->index) {
+    /* Another opener rebuilt the index. */
+    inode_close(dir->index);
+    dir->index = NULL;
+  }
+  if (dir->index == NULL) {
+    dir->index = inode_open(h->index);
+    if (dir->index != NULL)
+      inode_set_metadata(dir->index);
+  }
+  return dir->index;
+}
+
+/* Returns the number of buckets in INDEX, or 0 if INDEX does not
+   look like an index. */
+static uint32_t index_bucket_cnt(struct inode *index) {
+  struct index_header ih;
+
+  if (inode_read_at(index, &ih, sizeof ih, 0) != sizeof ih ||
+      ih.magic != INDEX_MAGIC)
+    return 0;
+  return ih.bucket_cnt;
+}
+
+/* Returns the offset in INDEX of the first sector of the bucket
+   for HASH, of which there are BUCKET_CNT. */
+static off_t index_bucket(uint32_t hash, uint32_t bucket_cnt) {
+  return (off_t)(1 + hash % bucket_cnt) * BLOCK_SECTOR_SIZE;
+}
+
+/* Records in INDEX that the entry for a name with HASH is at
+   OFS.  Returns true if successful, false on failure. */
+static bool index_insert(struct inode *index, uint32_t hash, uint32_t ofs) {
+  struct index_sector is;
+  uint32_t bucket_cnt = index_bucket_cnt(index);
+  off_t pos;
+
+  if (bucket_cnt == 0)
+    return false;
+
+  /* Find the first sector of the bucket with a free slot. */
+  pos = index_bucket(hash, bucket_cnt);
+  for (;;) {
+    if (inode_read_at(index, &is, sizeof is, pos) != sizeof is)
+      return false;
+    if (is.cnt < INDEX_SLOTS)
+      break;
+    if (is.next == 0) {
+      /* Chain a new sector to the end of the bucket. */
+      off_t end = inode_length(index);
+      is.next = end / BLOCK_SECTOR_SIZE;
+      if (inode_write_at(index, &is, sizeof is, pos) != sizeof is)
+        return false;
+      memset(&is, 0, sizeof is);
+      pos = end;
+      break;
+    }
+    pos = (off_t)is.next * BLOCK_SECTOR_SIZE;
+  }
+
+  is.slots[is.cnt].hash = hash;
+  is.slots[is.cnt].ofs = ofs;
+  is.cnt++;
+  return inode_write_at(index, &is, sizeof is, pos) == sizeof is;
+}
+
+/* Forgets the entry for a name with HASH at OFS in INDEX. */
+static void index_delete(struct inode *index, uint32_t hash, uint32_t ofs) {
+  struct index_sector is;
+  uint32_t bucket_cnt = index_bucket_cnt(index);
+  off_t pos;
+
+  if (bucket_cnt == 0)
+    return;
+
+  for (pos = index_bucket(hash, bucket_cnt);
+       inode_read_at(index, &is, sizeof is, pos) == sizeof is;
+       pos = (off_t)is.next * BLOCK_SECTOR_SIZE) {
+    for (uint32_t i = 0; i < is.cnt; i++)
+      if (is.slots[i].ofs == ofs) {
+        is.slots[i] = is.slots[--is.cnt];
+        inode_write_at(index, &is, sizeof is, pos);
+        return;
+      }
+    if (is.next == 0)
+      return;
+  }
+}
+
+/* Builds a hash index with BUCKET_CNT buckets of the entries of
+   DIR, whose header is *H, and makes it DIR's index in place of
+   any old one.  Returns true if successful, false on failure, in
+   which case DIR is left as it was. */
+static bool index_build(struct dir *dir, struct dir_header *h,
+                        uint32_t bucket_cnt) {
+  struct index_header ih = {.magic = INDEX_MAGIC, .bucket_cnt = bucket_cnt};
+  block_sector_t sector = 0;
+  struct inode *index;
+  struct dir_entry e;
+  off_t ofs;
+
+  if (!free_map_allocate_inode(inode_get_inumber(dir->inode), false,
+                               &sector))
+    return false;
+  /* The index gets its sectors only once it is open, so that
+     there is nothing but SECTOR to give back if it cannot be. */
+  if (!inode_create(sector, 0, false) ||
+      (index = inode_open(sector)) == NULL) {
+    free_map_release(sector, 1);
+    return false;
+  }
+  inode_set_metadata(index);
+  if (!inode_allocate(index, 0, (1 + bucket_cnt) * BLOCK_SECTOR_SIZE) ||
+      inode_write_at(index, &ih, sizeof ih, 0) != sizeof ih)
+    goto fail;
+
+  for (ofs = START_POS;
+       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    if (e.in_use && !index_insert(index, hash_string(e.name), ofs))
+      goto fail;
+
+  dir_drop_index(dir);
+  h->index = sector;
+  dir->index = index;
+  return true;
+
+fail:
+  inode_remove(index);
+  inode_close(index);
+  return false;
+}
+
+/* Removes the index of DIR, if it has one.  Its header is left
+   pointing to the removed index and must be rewritten. */
+static void dir_drop_index(struct dir *dir) {
+  struct dir_header h;
+
+  header_read(dir, &h);
+  if (index_get(dir, &h) != NULL) {
+    inode_remove(dir->index);
+    inode_close(dir->index);
+    dir->index = NULL;
+  }
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -94,12 +506,49 @@ struct inode *dir_get_inode(struct dir *dir) { return dir->inode; }
    otherwise, returns false and ignores EP and OFSP. */
 static bool lookup(const struct dir *dir, const char *name,
                    struct dir_entry *ep, off_t *ofsp) {
+  struct dir_header h;
   struct dir_entry e;
+  struct inode *index;
   size_t ofs;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
+  /* Only the index matters here, so don't count the entries of a
+     directory without a full header as header_read() would. */
+  inode_read_at(dir->inode, &h, sizeof h, 0);
+  index = h.magic == DIR_MAGIC ? index_get(dir, &h) : NULL;
+  if (index != NULL) {
+    struct index_sector is;
+    uint32_t hash = hash_string(name);
+    uint32_t bucket_cnt = index_bucket_cnt(index);
+    off_t pos;
+
+    if (bucket_cnt == 0)
+      goto linear;
+    for (pos = index_bucket(hash, bucket_cnt);
+         inode_read_at(index, &is, sizeof is, pos) == sizeof is;
+         pos = (off_t)is.next * BLOCK_SECTOR_SIZE) {
+      for (uint32_t i = 0; i < is.cnt; i++) {
+        if (is.slots[i].hash != hash)
+          continue;
+        ofs = is.slots[i].ofs;
+        if (inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e &&
+            e.in_use && !strcmp(name, e.name)) {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = ofs;
+          return true;
+        }
+      }
+      if (is.next == 0)
+        break;
+    }
+    return false;
+  }
+
+linear:
   for (ofs = START_POS;
        inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
@@ -119,6 +568,8 @@ static bool lookup(const struct dir *dir, const char *name,
    a null pointer.  The caller must close *INODE. */
 bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
   struct dir_entry e;
+  block_sector_t parent, sector = 0;
+  bool present;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
@@ -133,12 +584,19 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
     *inode = inode_open(e.inode_sector);
   }
 
-  else if (lookup(dir, name, &e, NULL))
-    *inode = inode_open(e.inode_sector);
-
-  // Not found
-  else
-    *inode = NULL;
+  // the dentry cache, then the directory itself
+  else {
+    parent = inode_get_inumber(dir->inode);
+    if (!dentry_get(parent, name, &present, &sector)) {
+      inode_lock(dir->inode);
+      present = lookup(dir, name, &e, NULL);
+      if (present)
+        sector = e.inode_sector;
+      dentry_put(parent, name, present, sector);
+      inode_unlock(dir->inode);
+    }
+    *inode = present ? inode_open(sector) : NULL;
+  }
 
   return *inode != NULL;
 }
@@ -151,8 +609,12 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode) {
    error occurs. */
 bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
              bool is_dir) {
+  struct dir_header h;
   struct dir_entry e;
+  struct inode *index;
+  block_sector_t parent, sector;
   off_t ofs;
+  bool present, indexed = true;
   bool success = false;
 
   ASSERT(dir != NULL);
@@ -162,24 +624,34 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
   if (*name == '\0' || strlen(name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup(dir, name, NULL, NULL))
+  /* Check that NAME is not in use, and that DIR has not been
+     removed since the caller opened it. */
+  journal_begin();
+  inode_lock(dir->inode);
+  parent = inode_get_inumber(dir->inode);
+  if (!dentry_get(parent, name, &present, &sector))
+    present = lookup(dir, name, NULL, NULL);
+  if (present || inode_is_removed(dir->inode))
     goto done;
+  dentry_drop(parent, name);
 
   // Update the child dir
   if (is_dir) {
-    if (!dir_add_subdir(inode_sector, e, dir))
+    if (!dir_add_subdir(inode_sector, dir))
       goto done;
   }
 
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
+     current end-of-file.  The header's FREE_OFS skips the slots
+     known to be in use.
 
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+  header_read(dir, &h);
+  for (ofs = h.free_ofs;
+       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
     if (!e.in_use)
       break;
@@ -188,9 +660,33 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector,
   e.in_use = true;
   strlcpy(e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+    goto done;
+
+  h.free_ofs = ofs + sizeof e;
+  h.entry_cnt++;
+  index = index_get(dir, &h);
+  if (index != NULL &&
+      h.entry_cnt > index_bucket_cnt(index) * INDEX_LOAD)
+    indexed = index_build(dir, &h, index_bucket_cnt(index) * 2);
+  else if (index != NULL)
+    indexed = index_insert(index, hash_string(name), ofs);
+  else if (h.entry_cnt >= INDEX_MIN_ENTRIES)
+    index_build(dir, &h, INDEX_MIN_BUCKETS);
+
+  /* Lookups trust an index, so one that misses the new entry
+     must go, leaving them to scan the entries. */
+  if (!indexed) {
+    dir_drop_index(dir);
+    h.index = 0;
+  }
+  success = header_write(dir, &h);
+  if (success)
+    dentry_put(parent, name, true, inode_sector);
 
 done:
+  inode_unlock(dir->inode);
+  journal_end();
   return success;
 }
 
@@ -198,8 +694,11 @@ done:
    Returns true if successful, false on failure,
    which occurs only if there is no file with the given NAME. */
 bool dir_remove(struct dir *dir, const char *name) {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
+  struct inode *index;
+  struct dir *target = NULL;
   bool success = false;
   off_t ofs;
 
@@ -207,6 +706,7 @@ bool dir_remove(struct dir *dir, const char *name) {
   ASSERT(name != NULL);
 
   /* Find directory entry. */
+  inode_lock(dir->inode);
   if (!lookup(dir, name, &e, &ofs))
     goto done;
 
@@ -215,26 +715,46 @@ bool dir_remove(struct dir *dir, const char *name) {
   if (inode == NULL)
     goto done;
 
-  /* Prevent removing non-empty dir. */
+  /* Prevent removing non-empty dir, and adding to it meanwhile. */
   if (inode_is_directory(inode)) {
-    struct dir *target = dir_open(inode);
-    bool is_empty = dir_is_empty(target);
-    dir_close(target);
-
-    if (!is_empty)
+    target = dir_open(inode_reopen(inode));
+    if (target == NULL)
+      goto done;
+    inode_lock(inode);
+    if (!dir_is_empty(target))
       goto done;
   }
 
   /* Erase directory entry. */
+  dentry_drop(inode_get_inumber(dir->inode), name);
   e.in_use = false;
   if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
 
-  /* Remove inode. */
+  header_read(dir, &h);
+  if (h.free_ofs > (uint32_t)ofs)
+    h.free_ofs = ofs;
+  h.entry_cnt--;
+  index = index_get(dir, &h);
+  if (index != NULL)
+    index_delete(index, hash_string(name), ofs);
+  header_write(dir, &h);
+  dentry_put(inode_get_inumber(dir->inode), name, false, 0);
+
+  /* Remove inode, and the index and dentries of a removed
+     directory. */
+  if (target != NULL) {
+    dir_drop_index(target);
+    dentry_purge(e.inode_sector);
+  }
   inode_remove(inode);
   success = true;
 
 done:
+  if (target != NULL)
+    inode_unlock(inode);
+  inode_unlock(dir->inode);
+  dir_close(target);
   inode_close(inode);
   return success;
 }
@@ -255,36 +775,56 @@ bool dir_readdir(struct dir *dir, char name[NAME_MAX + 1]) {
   return false;
 }
 
-/* Adds a subdirectory entry to DIR with the given INODE_SECTOR
-   and name E.
-   Returns true if successful, false on failure. */
-static bool dir_add_subdir(block_sector_t inode_sector, struct dir_entry e,
-                           struct dir *dir) {
-  struct dir *child_dir = dir_open(inode_open(inode_sector));
-  if (child_dir == NULL)
-    return false;
-
-  e.inode_sector = inode_get_inumber(dir_get_inode(dir));
-  if (inode_write_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
-    dir_close(child_dir);
-    return false;
+/* Directory entries that dir_readdir_many() reads at a time. */
+#define READDIR_BATCH 16
+
+/* Reads up to CNT more entries of DIR into ENTRIES, each with its
+   name, inode number and whether it is a directory.  Unlike
+   dir_readdir(), reads a batch of directory entries at a time, and
+   locks DIR once, so that the entries it returns are all there at
+   the same time.  Returns the number of entries read, 0 at the end
+   of DIR. */
+size_t dir_readdir_many(struct dir *dir, struct dirent *entries, size_t cnt) {
+  struct dir_entry batch[READDIR_BATCH];
+  size_t n = 0;
+
+  inode_lock(dir->inode);
+  while (n < cnt) {
+    off_t got = inode_read_at(dir->inode, batch, sizeof batch, dir->pos);
+    size_t batch_cnt = got / sizeof *batch;
+    if (batch_cnt == 0)
+      break;
+    for (size_t i = 0; i < batch_cnt && n < cnt; i++) {
+      dir->pos += sizeof *batch;
+      if (batch[i].in_use) {
+        struct dirent *d = &entries[n++];
+        d->inumber = batch[i].inode_sector;
+        d->is_dir = inode_sector_is_directory(batch[i].inode_sector);
+        strlcpy(d->name, batch[i].name, sizeof d->name);
+      }
+    }
   }
-  dir_close(child_dir);
-  return true;
+  inode_unlock(dir->inode);
+  return n;
+}
+
+/* Writes the header of the new directory in INODE_SECTOR, making
+   DIR its parent.
+   Returns true if successful, false on failure. */
+static bool dir_add_subdir(block_sector_t inode_sector, struct dir *dir) {
+  struct inode *child = inode_open(inode_sector);
+  bool success = child != NULL &&
+                 header_init(child, inode_get_inumber(dir_get_inode(dir)));
+  inode_close(child);
+  return success;
 }
 
 /* Returns whether the DIR is empty. */
 static bool dir_is_empty(const struct dir *dir) {
-  struct dir_entry e;
-  off_t ofs;
-
-  for (ofs = START_POS;
-       inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.in_use)
-      return false;
+  struct dir_header h;
 
-  return true;
+  header_read(dir, &h);
+  return h.entry_cnt == 0;
 }
 
 /* Split the name into dir and filename.
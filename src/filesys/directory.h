@@ -2,6 +2,7 @@
 #define FILESYS_DIRECTORY_H
 
 #include "devices/block.h"
+#include <dirent.h>
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -13,6 +14,8 @@
 
 struct inode;
 
+void dir_init(void);
+
 /* Opening and closing directories. */
 bool dir_create(block_sector_t sector, size_t entry_cnt);
 struct dir *dir_open(struct inode *);
@@ -26,6 +29,7 @@ bool dir_lookup(const struct dir *, const char *name, struct inode **);
 bool dir_add(struct dir *, const char *name, block_sector_t, bool is_dir);
 bool dir_remove(struct dir *, const char *name);
 bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdir_many(struct dir *, struct dirent *, size_t cnt);
 
 struct dir *dir_open_path(const char *);
 struct dir *dir_split(const char *name, char *file_name);
@@ -91,6 +91,16 @@ off_t file_write_at(struct file *file, const void *buffer, off_t size,
   return inode_write_at(file->inode, buffer, size, file_ofs);
 }
 
+/* Allocates disk space for the LENGTH bytes of FILE starting at
+   offset START, extending FILE if they go past its end.  The new
+   space reads as zeros.  Returns true if successful, false if the
+   disk is full or writes to FILE are denied.
+   The file's current position is unaffected. */
+bool file_allocate(struct file *file, off_t start, off_t length) {
+  ASSERT(file != NULL);
+  return inode_allocate(file->inode, start, length);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void file_deny_write(struct file *file) {
@@ -118,6 +128,12 @@ off_t file_length(struct file *file) {
   return inode_length(file->inode);
 }
 
+/* Returns the number of disk sectors that hold FILE's data. */
+size_t file_allocated_sectors(struct file *file) {
+  ASSERT(file != NULL);
+  return inode_allocated_sectors(file->inode);
+}
+
 /* Sets the current position in FILE to NEW_POS bytes from the
    start of the file. */
 void file_seek(struct file *file, off_t new_pos) {
@@ -2,6 +2,8 @@
 #define FILESYS_FILE_H
 
 #include "filesys/off_t.h"
+#include <stdbool.h>
+#include <stddef.h>
 
 struct inode;
 
@@ -16,6 +18,7 @@ off_t file_read(struct file *, void *, off_t);
 off_t file_read_at(struct file *, void *, off_t size, off_t start);
 off_t file_write(struct file *, const void *, off_t);
 off_t file_write_at(struct file *, const void *, off_t size, off_t start);
+bool file_allocate(struct file *, off_t start, off_t length);
 
 /* Preventing writes. */
 void file_deny_write(struct file *);
@@ -25,5 +28,6 @@ void file_allow_write(struct file *);
 void file_seek(struct file *, off_t);
 off_t file_tell(struct file *);
 off_t file_length(struct file *);
+size_t file_allocated_sectors(struct file *);
 
 #endif /* filesys/file.h */
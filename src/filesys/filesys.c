@@ -4,6 +4,7 @@
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 #include <debug.h>
 #include <stdio.h>
@@ -24,17 +25,21 @@ void filesys_init(bool format) {
   inode_init();
   free_map_init();
   cache_init();
+  dir_init();
 
   if (format)
     do_format();
 
+  journal_init();
   free_map_open();
 }
 
 /* Shuts down the file system module, writing any unwritten data
    to disk. */
 void filesys_done(void) {
+  inode_flush_delayed(0);
   free_map_close();
+  journal_done();
   cache_close();
 }
 
@@ -47,14 +52,21 @@ bool filesys_create(const char *name, off_t initial_size, bool is_dir) {
   block_sector_t inode_sector = 0;
   char file_name[strlen(name) + 1];
   struct dir *dir = dir_split(name, file_name);
+  block_sector_t parent =
+      dir != NULL ? inode_get_inumber(dir_get_inode(dir)) : ROOT_DIR_SECTOR;
 
-  bool success = (dir != NULL && free_map_allocate(1, &inode_sector) &&
+  journal_begin();
+  free_map_batch_begin();
+  bool success = (dir != NULL &&
+                  free_map_allocate_inode(parent, is_dir, &inode_sector) &&
                   inode_create(inode_sector, initial_size, is_dir) &&
                   dir_add(dir, file_name, inode_sector, is_dir));
 
   if (!success && inode_sector != 0)
     free_map_release(inode_sector, 1);
+  free_map_batch_end();
   dir_close(dir);
+  journal_end();
 
   return success;
 }
@@ -96,8 +108,10 @@ bool filesys_remove(const char *name) {
   char file_name[strlen(name) + 1];
   struct dir *dir = dir_split(name, file_name);
 
+  journal_begin();
   bool success = dir != NULL && dir_remove(dir, file_name);
   dir_close(dir);
+  journal_end();
 
   return success;
 }
@@ -109,6 +123,8 @@ static void do_format(void) {
   if (!dir_create(ROOT_DIR_SECTOR, 16))
     PANIC("root directory creation failed");
   free_map_close();
+  cache_flush();
+  journal_create();
   printf("done.\n");
 }
 
@@ -2,11 +2,90 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+
+/* All of the free map state below is protected by free_map_lock,
+   which the functions that this file exports take themselves. */
+static struct lock free_map_lock;
 
 static struct file *free_map_file; /* Free map file. */
 static struct bitmap *free_map;    /* Free map, one bit per sector. */
+static block_sector_t next_fit;    /* Where the next search starts. */
+
+/* The disk is split into groups of GROUP_SECTORS sectors.  Inodes
+   are allocated in the group of their parent directory and data
+   right after its inode or the file's last data, so that a file
+   and its directory stay close together on disk.
+
+   New runs preferably start on a SLOT_SECTORS boundary with the
+   rest of the slot free, which leaves room for the file that gets
+   the run to grow in place instead of interleaving its sectors
+   with those of other files growing at the same time.  Data that
+   cannot continue in place still goes within NEAR_SECTORS after
+   the file's last data if it fits there. */
+#define GROUP_SECTORS 4096
+#define SLOT_SECTORS 64
+#define NEAR_SECTORS 64
+static size_t group_cnt;   /* Number of groups. */
+static size_t *group_free; /* Free sectors in each group. */
+static size_t free_cnt;    /* Free sectors in all. */
+
+/* Free sectors promised to file data whose allocation is delayed
+   (see free_map_reserve()).  Other allocations leave them free. */
+static size_t reserved_cnt;
+
+/* Changes to the free map reach the free map file one file sector
+   at a time: only the sectors of the file whose bits changed are
+   written, and not before the outermost batch of the thread that
+   made them ends.  Each thread counts its own batches, so a batch
+   open in one thread does not hold back the changes of another,
+   which must reach the journal in the same transaction as the rest
+   of that thread's handle.  Writing out the changes of a batch
+   that is still open along with them is harmless, since its handle
+   is open too and the commit waits for it. */
+static struct bitmap *dirty; /* Free map file sectors to write. */
+
+/* Free map bits per sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Recounts the free sectors in each group. */
+static void group_recount(void) {
+  size_t size = bitmap_size(free_map);
+  free_cnt = 0;
+  for (size_t g = 0; g < group_cnt; g++) {
+    size_t start = g * GROUP_SECTORS;
+    size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+    group_free[g] = bitmap_count(free_map, start, cnt, false);
+    free_cnt += group_free[g];
+  }
+}
+
+/* Updates the group free counts for CNT sectors starting at
+   SECTOR becoming used, if USED is true, or free. */
+static void group_account(block_sector_t sector, size_t cnt, bool used) {
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+  while (cnt > 0) {
+    size_t g = sector / GROUP_SECTORS;
+    size_t n = (g + 1) * GROUP_SECTORS - sector;
+    if (n > cnt)
+      n = cnt;
+    if (used)
+      group_free[g] -= n;
+    else
+      group_free[g] += n;
+    sector += n;
+    cnt -= n;
+  }
+}
 
 /* Initializes the free map. */
 void free_map_init(void) {
@@ -15,55 +94,337 @@ void free_map_init(void) {
     PANIC("bitmap creation failed--file system device is too large");
   bitmap_mark(free_map, FREE_MAP_SECTOR);
   bitmap_mark(free_map, ROOT_DIR_SECTOR);
+  if (bitmap_size(free_map) >= JOURNAL_MIN_DISK)
+    bitmap_set_multiple(free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  next_fit = 0;
+
+  group_cnt = DIV_ROUND_UP(bitmap_size(free_map), GROUP_SECTORS);
+  group_free = malloc(group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC("can't allocate free map groups");
+  group_recount();
+  reserved_cnt = 0;
+
+  dirty = bitmap_create(
+      DIV_ROUND_UP(bitmap_file_size(free_map), BLOCK_SECTOR_SIZE));
+  if (dirty == NULL)
+    PANIC("bitmap creation failed--file system device is too large");
+  lock_init(&free_map_lock);
+}
+
+/* Notes that the bits for CNT sectors starting at SECTOR
+   changed. */
+static void mark_dirty(block_sector_t sector, size_t cnt) {
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple(dirty, first, last - first + 1, true);
+}
+
+/* Writes the dirty sectors of the free map file, each run of
+   adjacent ones in a single write, unless the running thread has a
+   batch open or the file does not exist yet.
+   Returns false if the free map file could not be written. */
+static bool free_map_persist(void) {
+  size_t start = 0;
+
+  if (free_map_file == NULL || thread_current()->batch_depth > 0)
+    return true;
+
+  while ((start = bitmap_scan(dirty, start, 1, true)) != BITMAP_ERROR) {
+    size_t end = start + 1;
+    while (end < bitmap_size(dirty) && bitmap_test(dirty, end))
+      end++;
+
+    size_t first_bit = start * BITS_PER_SECTOR;
+    size_t end_bit = end * BITS_PER_SECTOR;
+    if (end_bit > bitmap_size(free_map))
+      end_bit = bitmap_size(free_map);
+    if (!bitmap_write_range(free_map, free_map_file, first_bit,
+                            end_bit - first_bit))
+      return false;
+    bitmap_set_multiple(dirty, start, end - start, false);
+    start = end;
+  }
+  return true;
+}
+
+/* Opens a batch of free map changes.  Until the matching
+   free_map_batch_end(), allocations and releases only update the
+   free map in memory, so that growing a file by many sectors
+   writes each changed free map sector once.  Batches nest, and
+   belong to the running thread. */
+void free_map_batch_begin(void) {
+  thread_current()->batch_depth++;
+}
+
+/* Closes a batch of free map changes and, if it was the
+   outermost one, writes the changed sectors of the free map
+   file. */
+void free_map_batch_end(void) {
+  struct thread *t = thread_current();
+
+  lock_acquire(&free_map_lock);
+  ASSERT(t->batch_depth > 0);
+  t->batch_depth--;
+  if (!free_map_persist())
+    PANIC("can't write free map");
+  lock_release(&free_map_lock);
+}
+
+/* Marks the CNT free sectors starting at SECTOR as used and
+   stores SECTOR into *SECTORP.  Unless RESERVED, the sectors
+   reserved for delayed data must stay free.
+   Returns false if SECTOR is BITMAP_ERROR, if the sectors are
+   reserved or if the free_map file could not be written. */
+static bool claim(size_t sector, size_t cnt, bool reserved,
+                  block_sector_t *sectorp) {
+  if (sector == BITMAP_ERROR)
+    return false;
+  if (!reserved && free_cnt < reserved_cnt + cnt)
+    return false;
+
+  bitmap_set_multiple(free_map, sector, cnt, true);
+  group_account(sector, cnt, true);
+  mark_dirty(sector, cnt);
+  if (!free_map_persist()) {
+    bitmap_set_multiple(free_map, sector, cnt, false);
+    group_account(sector, cnt, false);
+    return false;
+  }
+  *sectorp = sector;
+  return true;
+}
+
+/* Returns the first sector at or after START and before END that
+   starts CNT free sectors, or BITMAP_ERROR if there is none. */
+static size_t scan_range(size_t start, size_t end, size_t cnt) {
+  size_t sector = bitmap_scan(free_map, start, cnt, false);
+  return sector < end ? sector : BITMAP_ERROR;
+}
+
+/* Returns the first multiple of SLOT_SECTORS at or after START
+   and before END that starts CNT free sectors, or BITMAP_ERROR if
+   there is none. */
+static size_t scan_slots(size_t start, size_t end, size_t cnt) {
+  size_t sector = ROUND_UP(start, SLOT_SECTORS);
+
+  while (sector < end) {
+    size_t found = scan_range(sector, end, cnt);
+    if (found == BITMAP_ERROR || found % SLOT_SECTORS == 0)
+      return found;
+    sector = ROUND_UP(found, SLOT_SECTORS);
+  }
+  return BITMAP_ERROR;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The search starts where the last
+   one left off and wraps around, so that it does not walk over
+   the same allocated sectors every time.
    Returns true if successful, false if not enough consecutive
    sectors were available or if the free_map file could not be
    written. */
 bool free_map_allocate(size_t cnt, block_sector_t *sectorp) {
-  block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR && free_map_file != NULL &&
-      !bitmap_write(free_map, free_map_file)) {
-    bitmap_set_multiple(free_map, sector, cnt, false);
-    sector = BITMAP_ERROR;
+  bool success;
+
+  lock_acquire(&free_map_lock);
+  size_t sector = bitmap_scan(free_map, next_fit, cnt, false);
+  if (sector == BITMAP_ERROR && next_fit > 0)
+    sector = bitmap_scan(free_map, 0, cnt, false);
+  success = claim(sector, cnt, false, sectorp);
+  if (success)
+    next_fit = sector + cnt;
+  lock_release(&free_map_lock);
+  return success;
+}
+
+/* Finds CNT free sectors close to GOAL and claims them, storing
+   the first into *SECTORP.  If NEAR, first looks just after GOAL,
+   where a file whose data ends at GOAL would continue with the
+   least seeking.  Then looks for the start of a free slot in
+   GOAL's group, for any free run there, for a free slot in the
+   groups that follow, wrapping around, and finally for any free
+   run at all.  RESERVED is as for claim().  The caller must hold
+   free_map_lock. */
+static bool allocate_near(size_t cnt, block_sector_t goal, bool near,
+                          bool reserved, block_sector_t *sectorp) {
+  size_t size = bitmap_size(free_map);
+  if (goal >= size)
+    goal = 0;
+
+  size_t group_start = goal - goal % GROUP_SECTORS;
+  size_t group_end = group_start + GROUP_SECTORS;
+  size_t slot = goal - goal % SLOT_SECTORS;
+  size_t room = ROUND_UP(cnt, SLOT_SECTORS);
+  size_t sector = BITMAP_ERROR;
+
+  if (near)
+    sector = scan_range(goal, goal + NEAR_SECTORS, cnt);
+  if (sector == BITMAP_ERROR)
+    sector = scan_slots(slot, group_end, room);
+  if (sector == BITMAP_ERROR)
+    sector = scan_slots(group_start, slot, room);
+  if (sector == BITMAP_ERROR)
+    sector = scan_range(goal, group_end, cnt);
+  if (sector == BITMAP_ERROR)
+    sector = scan_range(group_start, goal, cnt);
+  if (sector == BITMAP_ERROR)
+    sector = scan_slots(group_end, size, room);
+  if (sector == BITMAP_ERROR)
+    sector = scan_slots(0, group_start, room);
+  if (sector == BITMAP_ERROR)
+    sector = bitmap_scan(free_map, 0, cnt, false);
+  return claim(sector, cnt, reserved, sectorp);
+}
+
+/* Allocates CNT consecutive sectors for file data that would best
+   start at GOAL and stores the first into *SECTORP.  If RESERVED,
+   they may be sectors reserved with free_map_reserve(), which the
+   caller then gives back with free_map_unreserve().
+   Returns true if successful, false if not enough consecutive
+   sectors were available or if the free_map file could not be
+   written. */
+bool free_map_allocate_near(size_t cnt, block_sector_t goal, bool reserved,
+                            block_sector_t *sectorp) {
+  bool success;
+
+  lock_acquire(&free_map_lock);
+  success = allocate_near(cnt, goal, true, reserved, sectorp);
+  lock_release(&free_map_lock);
+  return success;
+}
+
+/* Allocates a sector for the inode of a new file or, if IS_DIR,
+   directory in the directory whose inode is at PARENT, and stores
+   it into *SECTORP.  Files go in their parent's group.  So do
+   directories, unless that group has less free space than the
+   average group, in which case they go to the group with the
+   most free space, which spreads directory trees over the disk
+   while it fills up.  Either way the inode starts a free slot if
+   possible, so that the file's data can follow it.
+   Returns true if successful, false if the disk is full or if
+   the free_map file could not be written. */
+bool free_map_allocate_inode(block_sector_t parent, bool is_dir,
+                             block_sector_t *sectorp) {
+  size_t parent_group = parent / GROUP_SECTORS;
+  size_t total = 0, best = parent_group;
+  block_sector_t goal = parent;
+  bool success;
+
+  lock_acquire(&free_map_lock);
+  if (is_dir && parent_group < group_cnt) {
+    for (size_t g = 0; g < group_cnt; g++) {
+      total += group_free[g];
+      if (group_free[g] > group_free[best])
+        best = g;
+    }
+    if (group_free[parent_group] * group_cnt < total)
+      goal = best * GROUP_SECTORS;
   }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  success = allocate_near(1, goal, false, false, sectorp);
+  lock_release(&free_map_lock);
+  return success;
+}
+
+/* Allocates up to CNT free sectors starting exactly at SECTOR,
+   stopping at the first sector in use, so that a run of sectors
+   can grow in place.  RESERVED is as for free_map_allocate_near().
+   Returns the number of sectors allocated, which is 0 if SECTOR
+   is in use or if the free_map file could not be written. */
+size_t free_map_extend(block_sector_t sector, size_t cnt, bool reserved) {
+  block_sector_t first;
+  size_t n = 0;
+
+  lock_acquire(&free_map_lock);
+  while (n < cnt && sector + n < bitmap_size(free_map) &&
+         !bitmap_test(free_map, sector + n))
+    n++;
+  if (n > 0 && !claim(sector, n, reserved, &first))
+    n = 0;
+  lock_release(&free_map_lock);
+  return n;
+}
+
+/* Sets aside CNT free sectors for file data that gets its sectors
+   later, so that allocating them then cannot fail for lack of
+   space.  Returns false if fewer than CNT sectors are free and not
+   reserved already. */
+bool free_map_reserve(size_t cnt) {
+  bool success;
+
+  lock_acquire(&free_map_lock);
+  success = free_cnt >= reserved_cnt + cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release(&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors reserved with free_map_reserve(), once
+   they are allocated or no longer needed. */
+void free_map_unreserve(size_t cnt) {
+  lock_acquire(&free_map_lock);
+  ASSERT(reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release(&free_map_lock);
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void free_map_release(block_sector_t sector, size_t cnt) {
+  lock_acquire(&free_map_lock);
   ASSERT(bitmap_all(free_map, sector, cnt));
+  journal_revoke(sector, cnt);
   bitmap_set_multiple(free_map, sector, cnt, false);
-  bitmap_write(free_map, free_map_file);
+  group_account(sector, cnt, false);
+  mark_dirty(sector, cnt);
+  free_map_persist();
+  lock_release(&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void free_map_open(void) {
+  lock_acquire(&free_map_lock);
   free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC("can't open free map");
   if (!bitmap_read(free_map, free_map_file))
     PANIC("can't read free map");
+  group_recount();
+  lock_release(&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
-void free_map_close(void) { file_close(free_map_file); }
+void free_map_close(void) {
+  lock_acquire(&free_map_lock);
+  ASSERT(thread_current()->batch_depth == 0);
+  if (!free_map_persist())
+    PANIC("can't write free map");
+  file_close(free_map_file);
+  lock_release(&free_map_lock);
+}
 
 /* Creates a new free map file on disk and writes the free map to
-   it. */
+   it.  The new file is a hole, so writing it allocates its data
+   sectors, which marks them in the free map before the free map
+   is copied out.  That happens while formatting, before anything
+   else uses the free map, and before free_map_file is set, so
+   that the allocations do not try to write the file too. */
 void free_map_create(void) {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create(FREE_MAP_SECTOR, bitmap_file_size(free_map), false))
     PANIC("free map creation failed");
 
   /* Write bitmap to file. */
-  free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  file = file_open(inode_open(FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC("can't open free map");
-  if (!bitmap_write(free_map, free_map_file))
+  if (!bitmap_write(free_map, file))
     PANIC("can't write free map");
+
+  lock_acquire(&free_map_lock);
+  free_map_file = file;
+  bitmap_set_all(dirty, false);
+  lock_release(&free_map_lock);
 }
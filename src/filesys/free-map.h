@@ -12,6 +12,16 @@ void free_map_open(void);
 void free_map_close(void);
 
 bool free_map_allocate(size_t, block_sector_t *);
+bool free_map_allocate_near(size_t, block_sector_t goal, bool reserved,
+                            block_sector_t *);
+bool free_map_allocate_inode(block_sector_t parent, bool is_dir,
+                             block_sector_t *);
+size_t free_map_extend(block_sector_t, size_t, bool reserved);
 void free_map_release(block_sector_t, size_t);
+bool free_map_reserve(size_t);
+void free_map_unreserve(size_t);
+
+void free_map_batch_begin(void);
+void free_map_batch_end(void);
 
 #endif /* filesys/free-map.h */
@@ -1,15 +1,30 @@
 #include "filesys/inode.h"
+#include "devices/timer.h"
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 #include <debug.h>
+#include <hash.h>
 #include <list.h>
 #include <round.h>
+#include <stddef.h>
 #include <string.h>
 
-/* Identifies an inode. */
+/* Identifies an inode.  The magic number also tells how the
+   inode describes its data: INODE_MAGIC inodes have a sector
+   pointer per data sector, as on disks formatted before extents,
+   INODE_EXTENT_MAGIC inodes have a list of extents, and
+   INODE_INLINE_MAGIC inodes hold their data themselves.  New
+   files start out inline and move to extents once they outgrow
+   the inode; new directories use extents from the start. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45
+#define INODE_INLINE_MAGIC 0x494e4f46
 
 /* 128 - other */
 #define DIRECT_BLOCKS_COUNT 123
@@ -21,16 +36,68 @@
 #define DOUBLY_INDIRECT_BLOCKS_PER_SECTOR                                      \
   (INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR)
 
+/* A run of LENGTH consecutive data sectors starting at disk
+   sector START.  A file's extents follow each other in file
+   order.  An extent that starts at HOLE_SECTOR is a hole: its
+   sectors have no disk sectors until they are first written, and
+   read as zeros.  An extent whose START has UNWRITTEN set has disk
+   sectors, allocated ahead by inode_allocate(), that have never
+   been written: they read as zeros too, whatever the disk holds
+   there. */
+struct extent {
+  block_sector_t start; /* First disk sector, or HOLE_SECTOR. */
+  uint32_t length;      /* Number of sectors. */
+};
+
+/* Start of a hole.  No data can be there, since sector 0 holds
+   the free map's inode. */
+#define HOLE_SECTOR 0
+
+/* Marks the start of an unwritten extent.  Disk sectors are all
+   below it. */
+#define UNWRITTEN 0x80000000u
+
+/* Extents kept in the inode sector and in each overflow block. */
+#define INODE_EXTENTS 61
+#define BLOCK_EXTENTS 63
+
+/* Bytes of data an inline inode holds. */
+#define INODE_INLINE_BYTES 500
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk {
   bool is_dir;    /* True if this inode is a dir. */
   off_t length;   /* File size in bytes. */
-  unsigned magic; /* Magic number. */
+  unsigned magic; /* Magic number, which tells the layout below. */
+
+  union {
+    /* INODE_MAGIC. */
+    struct {
+      block_sector_t indirect_block;        /* Single indirect block. */
+      block_sector_t doubly_indirect_block; /* Doubly indirect block. */
+      block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
+    };
+
+    /* INODE_EXTENT_MAGIC.  Extents past the first INODE_EXTENTS
+       live in a chain of overflow blocks. */
+    struct {
+      uint32_t extent_cnt;        /* Number of extents in all. */
+      block_sector_t extent_next; /* First overflow block, 0 if none. */
+      struct extent extents[INODE_EXTENTS];
+    };
+
+    /* INODE_INLINE_MAGIC.  Zeros past LENGTH. */
+    uint8_t inline_data[INODE_INLINE_BYTES];
+  };
+};
 
-  block_sector_t indirect_block;        /* Single indirect block. */
-  block_sector_t doubly_indirect_block; /* Doubly indirect block. */
-  block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
+/* Overflow block of an extent inode.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct extent_block {
+  block_sector_t next; /* Next overflow block, 0 if none. */
+  uint32_t unused;
+  struct extent extents[BLOCK_EXTENTS];
 };
 
 /* Indirect block sector.
@@ -39,18 +106,96 @@ struct inode_indirect_block_sector {
   block_sector_t blocks[INDIRECT_BLOCKS_PER_SECTOR];
 };
 
-/* In-memory inode. */
+/* A copy of one indirect block of an inode, mapping the
+   INDIRECT_BLOCKS_PER_SECTOR data sectors starting at index
+   FIRST of the file.  An inode keeps BLOCK_MAP_SLOTS of them, so
+   that read-ahead running into the next indirect block does not
+   evict the one the reader is still in. */
+#define BLOCK_MAP_SLOTS 2
+struct block_map {
+  off_t first; /* First sector index mapped, -1 if none. */
+  block_sector_t sectors[INDIRECT_BLOCKS_PER_SECTOR];
+};
+
+/* In-memory inode.
+
+   OPEN_CNT and REMOVED are protected by open_inodes_lock.  Reads
+   hold RWLOCK for reading, so that readers of one inode run in
+   parallel, and writes, which may grow the inode, hold it for
+   writing.  Readers still update the read-ahead state and the
+   lookup caches below, under STATE_LOCK. */
 struct inode {
-  struct list_elem elem;  /* Element in inode list. */
+  struct hash_elem elem;  /* Element in open_inodes. */
   block_sector_t sector;  /* Sector number of disk location. */
   int open_cnt;           /* Number of openers. */
   bool removed;           /* True if deleted, false otherwise. */
   int deny_write_cnt;     /* 0: writes ok, >0: deny writes. */
   struct inode_disk data; /* Inode content. */
+  struct rwlock rwlock;   /* Held by readers and writers of the data. */
+  struct lock state_lock; /* Guards the state below during reads. */
+  struct lock lock;       /* For inode_lock(). */
+  bool metadata;          /* See inode_set_metadata(). */
+
+  /* Sequential read detection. */
+  off_t ra_next;    /* Sector index a sequential read continues at. */
+  off_t ra_end;     /* Read-ahead has been issued below this index. */
+  size_t ra_window; /* Sectors to keep in flight, 0 if not sequential. */
+
+  /* Recently used indirect blocks. */
+  struct block_map *maps[BLOCK_MAP_SLOTS]; /* Allocated on first use. */
+  int map_last;                            /* Slot used last. */
+
+  /* Extent layout. */
+  struct extent *more_extents; /* Extents past the INODE_EXTENTS. */
+  size_t more_cap;             /* Room in MORE_EXTENTS. */
+  block_sector_t *ext_blocks;  /* Overflow blocks, in chain order. */
+  size_t ext_block_cnt;        /* Number of overflow blocks. */
+  size_t ext_dirty;            /* First overflow block to write back. */
+  size_t ext_sectors;          /* Data sectors the extents cover... */
+  size_t ext_allocated;        /* ...and those not in holes. */
+  size_t ext_cursor;           /* Extent the last lookup ended in... */
+  off_t ext_cursor_first;      /* ...and its first sector index. */
+
+  /* Delayed allocation, see delay_write(). */
+  uint8_t *delay_buf;          /* Data of the delayed sectors... */
+  off_t delay_first;           /* ...the index of the first... */
+  size_t delay_cnt;            /* ...and their number. */
+  int64_t delay_since;         /* When the first was delayed. */
+  struct list_elem delay_elem; /* In delayed_inodes, with DELAY_BUF. */
 };
 
+/* Delayed allocation.  Writes that fall in holes of a file, as
+   appends do, go into a buffer of up to DELAY_SECTORS sectors that
+   continue each other, which get disk sectors only when they are
+   written back: when a write does not fit the buffer, when the
+   file is closed, or when the write-behind daemon finds them older
+   than the flush age.  A burst of small appends then takes one run
+   of sectors, and a file removed before then takes none.  The
+   sectors are reserved in the free map meanwhile, with
+   DELAY_META_SECTORS more for the overflow blocks their extents
+   may need, and the inode keeps room in memory for those extents,
+   so that writing them back cannot fail.  At most DELAY_INODES
+   inodes have a buffer at a time. */
+#define DELAY_SECTORS 32
+#define DELAY_META_SECTORS DIV_ROUND_UP(2 * DELAY_SECTORS, BLOCK_EXTENTS)
+#define DELAY_PAGES DIV_ROUND_UP(DELAY_SECTORS * BLOCK_SECTOR_SIZE, PGSIZE)
+#define DELAY_INODES 8
+static struct list delayed_inodes; /* Inodes with a DELAY_BUF. */
+static struct lock delay_lock;     /* Protects delayed_inodes. */
+
+/* Extents that writing back INODE's delayed sectors may add, two
+   for each run of sectors they get. */
+#define DELAY_EXTENTS(INODE) (2 * (INODE)->delay_cnt)
+
+/* Bounds of the read-ahead window, in sectors. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 32
+
 static bool inode_allocate_sector(struct inode_disk *disk_inode, off_t length);
+static void delay_flush(struct inode *inode);
+static void delay_stop(struct inode *inode);
 static bool inode_deallocate(struct inode *inode);
+static bool inode_extend(struct inode *inode, off_t length);
 
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
@@ -68,65 +213,749 @@ bool inode_is_directory(const struct inode *inode) {
   return inode->data.is_dir;
 }
 
+/* Returns whether the inode in SECTOR, which need not be open, is
+   a directory. */
+bool inode_sector_is_directory(block_sector_t sector) {
+  bool is_dir;
+  cache_read_at(sector, offsetof(struct inode_disk, is_dir), sizeof is_dir,
+                &is_dir, CACHE_META);
+  return is_dir;
+}
+
+/* Returns the cache hint for INODE's data.  Directories, the
+   free map and inodes marked with inode_set_metadata() are file
+   system metadata, which the journal protects. */
+static enum cache_hint inode_hint(const struct inode *inode) {
+  return inode->data.is_dir || inode->sector == FREE_MAP_SECTOR ||
+                 inode->metadata
+             ? CACHE_META
+             : CACHE_DATA;
+}
+
+/* Marks the data of INODE, which is not a directory, as file
+   system metadata. */
+void inode_set_metadata(struct inode *inode) { inode->metadata = true; }
+
 /* Returns the block device sector of direct block. */
 static block_sector_t index_direct(const struct inode_disk *idisk,
                                    off_t index) {
   return idisk->direct_blocks[index];
 }
 
+/* Looks up data sector INDEX of INODE in its block maps, if one
+   of them holds the indirect block for the sectors starting at
+   FIRST.  Returns true and stores the sector in *SECTOR if so. */
+static bool block_map_lookup(struct inode *inode, off_t first, off_t index,
+                             block_sector_t *sector) {
+  for (int i = 0; i < BLOCK_MAP_SLOTS; i++) {
+    const struct block_map *map = inode->maps[i];
+    if (map != NULL && map->first == first) {
+      inode->map_last = i;
+      *sector = map->sectors[index - first];
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns data sector INDEX of INODE from indirect block BLOCK,
+   which maps the sectors starting at FIRST, and keeps a copy of
+   BLOCK in one of INODE's block maps, replacing the one used
+   least recently, for the lookups that follow. */
+static block_sector_t block_map_load(struct inode *inode, block_sector_t block,
+                                     off_t first, off_t index) {
+  int slot = (inode->map_last + 1) % BLOCK_MAP_SLOTS;
+  if (inode->maps[slot] == NULL)
+    inode->maps[slot] = malloc(sizeof *inode->maps[slot]);
+
+  struct block_map *map = inode->maps[slot];
+  if (map == NULL) {
+    // Out of memory: read the one entry instead.
+    block_sector_t ret;
+    cache_read_at(block, (index - first) * sizeof ret, sizeof ret, &ret,
+                  CACHE_META);
+    return ret;
+  }
+
+  cache_read(block, map->sectors, CACHE_META);
+  map->first = first;
+  inode->map_last = slot;
+  return map->sectors[index - first];
+}
+
+/* Forgets INODE's block maps, whose indirect blocks may change. */
+static void block_map_invalidate(struct inode *inode) {
+  for (int i = 0; i < BLOCK_MAP_SLOTS; i++)
+    if (inode->maps[i] != NULL)
+      inode->maps[i]->first = -1;
+}
+
 /* Returns the block device sector of indirect block. */
-static block_sector_t index_indirect(const struct inode_disk *idisk,
-                                     off_t index) {
-  struct inode_indirect_block_sector *indirect_idisk;
-  indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
-  cache_read(idisk->indirect_block, indirect_idisk);
+static block_sector_t index_indirect(struct inode *inode, off_t index) {
+  off_t first = DIRECT_BLOCKS_COUNT;
+  block_sector_t ret;
 
-  block_sector_t ret = indirect_idisk->blocks[index];
-  free(indirect_idisk);
-  return ret;
+  if (block_map_lookup(inode, first, index, &ret))
+    return ret;
+  return block_map_load(inode, inode->data.indirect_block, first, index);
 }
 
 /* Returns the block device sector of doubly indirect block. */
-static block_sector_t index_doubly_indirect(const struct inode_disk *idisk,
+static block_sector_t index_doubly_indirect(struct inode *inode,
                                             off_t index) {
-  struct inode_indirect_block_sector *indirect_idisk;
-  indirect_idisk = calloc(1, sizeof(struct inode_indirect_block_sector));
+  off_t base = DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR;
+  off_t leaf = (index - base) / INDIRECT_BLOCKS_PER_SECTOR;
+  off_t first = base + leaf * INDIRECT_BLOCKS_PER_SECTOR;
+  block_sector_t ret;
+
+  if (block_map_lookup(inode, first, index, &ret))
+    return ret;
 
   // first level
-  cache_read(idisk->doubly_indirect_block, indirect_idisk);
+  block_sector_t block;
+  cache_read_at(inode->data.doubly_indirect_block, leaf * sizeof block,
+                sizeof block, &block, CACHE_META);
 
   // second level
-  cache_read(indirect_idisk->blocks[index / INDIRECT_BLOCKS_PER_SECTOR],
-             indirect_idisk);
+  return block_map_load(inode, block, first, index);
+}
+
+/* Returns whether INODE_DISK describes its data as extents. */
+static inline bool uses_extents(const struct inode_disk *inode_disk) {
+  return inode_disk->magic == INODE_EXTENT_MAGIC;
+}
+
+/* Returns whether INODE_DISK holds its data itself. */
+static inline bool is_inline(const struct inode_disk *inode_disk) {
+  return inode_disk->magic == INODE_INLINE_MAGIC;
+}
+
+/* Moves the data of inline INODE into a data sector of its own
+   and makes INODE an extent inode, without writing back its inode
+   sector.  The data sector goes to disk at once, so that it is
+   there before the journal commits the inode that points to it.
+   Returns false if the disk is full or memory runs out. */
+static bool inline_spill(struct inode *inode) {
+  off_t length = inode->data.length;
+  block_sector_t sector = HOLE_SECTOR;
+
+  ASSERT(is_inline(&inode->data));
+  if (length > 0) {
+    uint8_t *block = calloc(1, BLOCK_SECTOR_SIZE);
+    if (block == NULL)
+      return false;
+    if (!free_map_allocate_near(1, inode->sector, false, &sector)) {
+      free(block);
+      return false;
+    }
+    memcpy(block, inode->data.inline_data, length);
+    cache_write(sector, block, CACHE_DATA);
+    cache_flush_sector(sector);
+    free(block);
+  }
+
+  memset(inode->data.inline_data, 0, sizeof inode->data.inline_data);
+  inode->data.magic = INODE_EXTENT_MAGIC;
+  if (length > 0) {
+    inode->data.extent_cnt = 1;
+    inode->data.extents[0].start = sector;
+    inode->data.extents[0].length = 1;
+    inode->ext_sectors = inode->ext_allocated = 1;
+  }
+  return true;
+}
+
+/* Returns the first disk sector of extent E, which is not a
+   hole. */
+static inline block_sector_t extent_sector(const struct extent *e) {
+  return e->start & ~UNWRITTEN;
+}
+
+/* Returns whether extent E is unwritten. */
+static inline bool extent_unwritten(const struct extent *e) {
+  return (e->start & UNWRITTEN) != 0;
+}
+
+/* Returns extent I of INODE. */
+static struct extent *extent_at(struct inode *inode, size_t i) {
+  ASSERT(i < inode->data.extent_cnt);
+  return i < INODE_EXTENTS ? &inode->data.extents[i]
+                           : &inode->more_extents[i - INODE_EXTENTS];
+}
+
+/* Returns the overflow block that holds extent I, which must be
+   past the first INODE_EXTENTS. */
+static inline size_t extent_block_no(size_t i) {
+  return (i - INODE_EXTENTS) / BLOCK_EXTENTS;
+}
+
+/* Reads the overflow extents of INODE, whose inode sector has
+   been read.  Returns false if memory allocation fails. */
+static bool extent_load(struct inode *inode) {
+  size_t cnt = inode->data.extent_cnt;
+
+  if (cnt > INODE_EXTENTS) {
+    size_t more = cnt - INODE_EXTENTS;
+    size_t blocks = DIV_ROUND_UP(more, BLOCK_EXTENTS);
+    struct extent_block *block = malloc(sizeof *block);
+    inode->more_extents = malloc(more * sizeof *inode->more_extents);
+    inode->ext_blocks = malloc(blocks * sizeof *inode->ext_blocks);
+    if (block == NULL || inode->more_extents == NULL ||
+        inode->ext_blocks == NULL) {
+      free(block);
+      return false;
+    }
+    inode->more_cap = more;
+    inode->ext_block_cnt = blocks;
+
+    block_sector_t next = inode->data.extent_next;
+    for (size_t b = 0; b < blocks; b++) {
+      size_t n = min(more - b * BLOCK_EXTENTS, BLOCK_EXTENTS);
+      inode->ext_blocks[b] = next;
+      cache_read(next, block, CACHE_META);
+      memcpy(&inode->more_extents[b * BLOCK_EXTENTS], block->extents,
+             n * sizeof *block->extents);
+      next = block->next;
+    }
+    free(block);
+  }
+
+  for (size_t i = 0; i < cnt; i++) {
+    struct extent *e = extent_at(inode, i);
+    inode->ext_sectors += e->length;
+    if (e->start != HOLE_SECTOR)
+      inode->ext_allocated += e->length;
+  }
+  return true;
+}
+
+/* Writes back the overflow blocks of INODE that changed.  The
+   inode sector itself is written by the caller. */
+static void extent_sync(struct inode *inode) {
+  struct extent_block block;
+  size_t cnt = inode->data.extent_cnt;
+
+  for (size_t b = inode->ext_dirty; b < inode->ext_block_cnt; b++) {
+    size_t first = INODE_EXTENTS + b * BLOCK_EXTENTS;
+    size_t n = min(cnt - first, BLOCK_EXTENTS);
+
+    memset(&block, 0, sizeof block);
+    block.next = b + 1 < inode->ext_block_cnt ? inode->ext_blocks[b + 1] : 0;
+    memcpy(block.extents, &inode->more_extents[first - INODE_EXTENTS],
+           n * sizeof *block.extents);
+    cache_write(inode->ext_blocks[b], &block, CACHE_META);
+  }
+  inode->ext_dirty = SIZE_MAX;
+}
+
+/* Notes that extent I of INODE changed, so that the overflow
+   block that holds it, if any, gets written back. */
+static void extent_changed(struct inode *inode, size_t i) {
+  if (i >= INODE_EXTENTS)
+    inode->ext_dirty = min(inode->ext_dirty, extent_block_no(i));
+}
 
-  block_sector_t ret =
-      indirect_idisk->blocks[index % INDIRECT_BLOCKS_PER_SECTOR];
+/* Grows the arrays of INODE's extents past the first
+   INODE_EXTENTS, and of its overflow blocks, so that they can
+   hold EXTRA more extents.  They never shrink, so that room made
+   for delayed sectors stays there until they are written back.
+   Returns false if memory runs out. */
+static bool extent_room(struct inode *inode, size_t extra) {
+  size_t cnt = inode->data.extent_cnt + extra;
+  if (cnt <= INODE_EXTENTS)
+    return true;
 
-  free(indirect_idisk);
-  return ret;
+  size_t more = cnt - INODE_EXTENTS;
+  if (more > inode->more_cap) {
+    size_t cap = inode->more_cap == 0 ? BLOCK_EXTENTS : inode->more_cap * 2;
+    if (cap < more)
+      cap = more;
+    struct extent *extents =
+        realloc(inode->more_extents, cap * sizeof *extents);
+    if (extents == NULL)
+      return false;
+    inode->more_extents = extents;
+    block_sector_t *blocks = realloc(
+        inode->ext_blocks, DIV_ROUND_UP(cap, BLOCK_EXTENTS) * sizeof *blocks);
+    if (blocks == NULL)
+      return false;
+    inode->ext_blocks = blocks;
+    inode->more_cap = cap;
+  }
+  return true;
+}
+
+/* Makes room for EXTRA more extents in INODE, growing its arrays
+   and chaining overflow blocks as needed, so that extent_insert()
+   cannot fail.  DELAYED is true when writing back delayed
+   sectors: the overflow blocks then come out of their reservation
+   in the free map, and the arrays have room already.  Otherwise
+   the arrays keep room for writing back the delayed sectors too.
+   Returns false if memory or an overflow block could not be
+   allocated, in which case the caller must call extent_trim(). */
+static bool extent_reserve(struct inode *inode, size_t extra, bool delayed) {
+  if (!extent_room(inode, delayed ? extra : extra + DELAY_EXTENTS(inode)))
+    return false;
+
+  size_t cnt = inode->data.extent_cnt + extra;
+  size_t more = cnt > INODE_EXTENTS ? cnt - INODE_EXTENTS : 0;
+  while (inode->ext_block_cnt < DIV_ROUND_UP(more, BLOCK_EXTENTS)) {
+    // Chain a new overflow block.
+    size_t b = inode->ext_block_cnt;
+    if (!free_map_allocate_near(1, inode->sector, delayed,
+                                &inode->ext_blocks[b]))
+      return false;
+    inode->ext_block_cnt++;
+    if (b == 0)
+      inode->data.extent_next = inode->ext_blocks[b];
+    inode->ext_dirty = min(inode->ext_dirty, b == 0 ? 0 : b - 1);
+  }
+  return true;
+}
+
+/* Releases the overflow blocks of INODE that hold no extents. */
+static void extent_trim(struct inode *inode) {
+  size_t cnt = inode->data.extent_cnt;
+  size_t blocks =
+      cnt > INODE_EXTENTS ? DIV_ROUND_UP(cnt - INODE_EXTENTS, BLOCK_EXTENTS)
+                          : 0;
+
+  if (inode->ext_block_cnt <= blocks)
+    return;
+  for (size_t b = blocks; b < inode->ext_block_cnt; b++)
+    free_map_release(inode->ext_blocks[b], 1);
+  inode->ext_block_cnt = blocks;
+  if (blocks == 0)
+    inode->data.extent_next = 0;
+  else
+    inode->ext_dirty = min(inode->ext_dirty, blocks - 1);
+}
+
+/* Inserts an extent before extent I of INODE, for which
+   extent_reserve() must have made room, moving the extents from I
+   on up by one, and returns it. */
+static struct extent *extent_insert(struct inode *inode, size_t i) {
+  size_t cnt = inode->data.extent_cnt++;
+
+  ASSERT(i <= cnt);
+  for (size_t j = cnt; j > i; j--)
+    *extent_at(inode, j) = *extent_at(inode, j - 1);
+  if (cnt >= INODE_EXTENTS)
+    extent_changed(inode, i > INODE_EXTENTS ? i : INODE_EXTENTS);
+  inode->ext_cursor = 0;
+  inode->ext_cursor_first = 0;
+  return extent_at(inode, i);
+}
+
+/* Removes extent I of INODE, moving the extents after it down by
+   one.  The caller should extent_trim() afterward. */
+static void extent_delete(struct inode *inode, size_t i) {
+  size_t cnt = inode->data.extent_cnt;
+
+  ASSERT(i < cnt);
+  for (size_t j = i; j + 1 < cnt; j++)
+    *extent_at(inode, j) = *extent_at(inode, j + 1);
+  inode->data.extent_cnt--;
+  if (cnt > INODE_EXTENTS)
+    extent_changed(inode, i > INODE_EXTENTS ? i : INODE_EXTENTS);
+  inode->ext_cursor = 0;
+  inode->ext_cursor_first = 0;
+}
+
+/* Returns whether a run that starts at disk sector START continues
+   extent E: both are holes, or START is the sector right after
+   E's data. */
+static bool extent_follows(const struct extent *e, block_sector_t start) {
+  if (e->start == HOLE_SECTOR || start == HOLE_SECTOR)
+    return e->start == start;
+  return e->start + e->length == start;
+}
+
+/* Grows INODE's extents to cover SECTORS data sectors.  The new
+   sectors are a hole, which takes no disk sectors until it is
+   written.  Returns false if memory or an overflow block could
+   not be allocated. */
+static bool extent_grow(struct inode *inode, size_t sectors) {
+  size_t cnt = inode->data.extent_cnt;
+  size_t length;
+
+  if (inode->ext_sectors >= sectors)
+    return true;
+  length = sectors - inode->ext_sectors;
+
+  if (cnt > 0 && extent_follows(extent_at(inode, cnt - 1), HOLE_SECTOR)) {
+    extent_at(inode, cnt - 1)->length += length;
+    extent_changed(inode, cnt - 1);
+  } else if (extent_reserve(inode, 1, false)) {
+    struct extent *e = extent_insert(inode, cnt);
+    e->start = HOLE_SECTOR;
+    e->length = length;
+  } else {
+    extent_trim(inode);
+    extent_sync(inode);
+    return false;
+  }
+  inode->ext_sectors = sectors;
+  extent_sync(inode);
+  return true;
+}
+
+/* Returns the extent of INODE that holds data sector INDEX, which
+   its extents must cover, and stores the index of its first data
+   sector in *FIRSTP.  Lookups start from where the previous one
+   ended, so sequential access costs O(1) per sector. */
+static size_t extent_find(struct inode *inode, off_t index, off_t *firstp) {
+  size_t i = 0;
+  off_t first = 0;
+
+  if (index >= inode->ext_cursor_first) {
+    i = inode->ext_cursor;
+    first = inode->ext_cursor_first;
+  }
+
+  for (; i < inode->data.extent_cnt; i++) {
+    struct extent *e = extent_at(inode, i);
+    if (index < first + (off_t)e->length) {
+      inode->ext_cursor = i;
+      inode->ext_cursor_first = first;
+      *firstp = first;
+      return i;
+    }
+    first += e->length;
+  }
+
+  NOT_REACHED();
+}
+
+/* Returns the disk sector of data sector INDEX of INODE, which
+   its extents must cover, or HOLE_SECTOR if it is in a hole or
+   unwritten, so that it reads as zeros. */
+static block_sector_t extent_lookup(struct inode *inode, off_t index) {
+  off_t first;
+  struct extent *e = extent_at(inode, extent_find(inode, index, &first));
+  if (e->start == HOLE_SECTOR || extent_unwritten(e))
+    return HOLE_SECTOR;
+  return e->start + (index - first);
+}
+
+/* Returns the sector where data for extent I of INODE would best
+   go: right after the data of the closest extent before it that
+   is not a hole, or right after the inode itself if there is
+   none. */
+static block_sector_t extent_goal(struct inode *inode, size_t i) {
+  while (i-- > 0) {
+    struct extent *e = extent_at(inode, i);
+    if (e->start != HOLE_SECTOR)
+      return extent_sector(e) + e->length;
+  }
+  return inode->sector + 1;
+}
+
+/* Gives data sectors INDEX to INDEX + CNT of INODE, which lie in
+   extent I whose first data sector is FIRST, the CNT disk sectors
+   starting at START, which may have UNWRITTEN set.  Extent I, a
+   hole or unwritten, is split around them, and they are merged
+   into the extents next to them if the disk sectors follow on.
+   DELAYED is as for extent_reserve().  Returns false if memory or
+   an overflow block could not be allocated. */
+static bool extent_place(struct inode *inode, size_t i, off_t first,
+                         off_t index, block_sector_t start, size_t cnt,
+                         bool delayed) {
+  struct extent *e;
+  block_sector_t old;
+  size_t before, after;
+
+  if (!extent_reserve(inode, 2, delayed)) {
+    extent_trim(inode);
+    return false;
+  }
+
+  e = extent_at(inode, i);
+  old = e->start;
+  before = index - first;
+  after = e->length - before - cnt;
+
+  if (before > 0) {
+    e->length = before;
+    extent_changed(inode, i);
+    e = extent_insert(inode, ++i);
+  }
+  e->start = start;
+  e->length = cnt;
+  extent_changed(inode, i);
+  if (after > 0) {
+    struct extent *rest = extent_insert(inode, i + 1);
+    rest->start = old == HOLE_SECTOR ? HOLE_SECTOR : old + before + cnt;
+    rest->length = after;
+  }
+
+  if (i + 1 < inode->data.extent_cnt &&
+      extent_follows(extent_at(inode, i), extent_at(inode, i + 1)->start)) {
+    extent_at(inode, i)->length += extent_at(inode, i + 1)->length;
+    extent_delete(inode, i + 1);
+  }
+  if (i > 0 &&
+      extent_follows(extent_at(inode, i - 1), extent_at(inode, i)->start)) {
+    extent_at(inode, i - 1)->length += extent_at(inode, i)->length;
+    extent_changed(inode, i - 1);
+    extent_delete(inode, i);
+  }
+  extent_trim(inode);
+  return true;
+}
+
+/* What extent_fill() does with the sectors in its range. */
+enum fill_mode {
+  FILL_WRITE,   /* Allocate holes and write unwritten sectors. */
+  FILL_DELAYED, /* The same, out of sectors reserved in the free map. */
+  FILL_PREALLOC /* Allocate holes as unwritten sectors. */
+};
+
+/* Allocates disk sectors for the holes that a write of SIZE bytes
+   at OFFSET to INODE falls in, and writes back its extents if
+   they changed.  Unless MODE is FILL_PREALLOC, the unwritten
+   sectors there become written, and a new or unwritten sector
+   that the write does not cover completely is zeroed first.  Each
+   run continues the data before it in place if the sectors there
+   are free, or else takes the longest run it can find near there,
+   down to a single sector.  A write that falls in no hole and no
+   unwritten sector does not touch the free map, so the free map
+   file itself can be written with free_map_lock held.  Returns
+   false if the disk is full or memory runs out. */
+static bool extent_fill(struct inode *inode, off_t offset, off_t size,
+                        enum fill_mode mode) {
+  static char zeros[BLOCK_SECTOR_SIZE];
+  off_t index = offset / BLOCK_SECTOR_SIZE;
+  off_t end = DIV_ROUND_UP(offset + size, BLOCK_SECTOR_SIZE);
+  bool batched = false, changed = false, success = true;
+
+  while (index < end) {
+    off_t first;
+    size_t i = extent_find(inode, index, &first);
+    struct extent *e = extent_at(inode, i);
+    off_t e_end = first + e->length;
+    bool hole = e->start == HOLE_SECTOR;
+
+    if (!hole && (!extent_unwritten(e) || mode == FILL_PREALLOC)) {
+      index = e_end;
+      continue;
+    }
+
+    size_t need = (e_end < end ? e_end : end) - index;
+    block_sector_t start;
+    size_t got;
+    if (hole) {
+      block_sector_t goal = extent_goal(inode, i);
+      bool reserved = mode == FILL_DELAYED;
+      if (!batched) {
+        free_map_batch_begin();
+        batched = true;
+      }
+      start = goal;
+      got = free_map_extend(goal, need, reserved);
+      if (got == 0) {
+        for (got = need; !free_map_allocate_near(got, goal, reserved, &start);
+             got /= 2)
+          if (got == 1) {
+            success = false;
+            goto done;
+          }
+      }
+    } else {
+      start = extent_sector(e) + (index - first);
+      got = need;
+    }
+
+    if (!extent_place(inode, i, first, index,
+                      mode == FILL_PREALLOC ? start | UNWRITTEN : start,
+                      got, mode == FILL_DELAYED)) {
+      if (hole)
+        free_map_release(start, got);
+      success = false;
+      goto done;
+    }
+    changed = true;
+    if (hole)
+      inode->ext_allocated += got;
+    if (mode == FILL_PREALLOC) {
+      index += got;
+      continue;
+    }
+
+    for (size_t k = 0; k < got; k++) {
+      off_t pos = (index + k) * BLOCK_SECTOR_SIZE;
+      if (pos < offset || pos + BLOCK_SECTOR_SIZE > offset + size)
+        cache_write(start + k, zeros, CACHE_DATA);
+    }
+    index += got;
+  }
+
+done:
+  if (batched)
+    free_map_batch_end();
+  if (changed || !success) {
+    extent_sync(inode);
+    cache_write(inode->sector, &inode->data, CACHE_META);
+  }
+  return success;
+}
+
+/* Releases the data sectors and overflow blocks of INODE. */
+static void extent_release(struct inode *inode) {
+  for (size_t i = 0; i < inode->data.extent_cnt; i++) {
+    struct extent *e = extent_at(inode, i);
+    if (e->start != HOLE_SECTOR)
+      free_map_release(extent_sector(e), e->length);
+  }
+  for (size_t b = 0; b < inode->ext_block_cnt; b++)
+    free_map_release(inode->ext_blocks[b], 1);
+}
+
+/* Returns whether data sectors INDEX to END of INODE, which its
+   extents must cover, all lie in holes. */
+static bool extent_all_holes(struct inode *inode, off_t index, off_t end) {
+  while (index < end) {
+    off_t first;
+    struct extent *e = extent_at(inode, extent_find(inode, index, &first));
+    if (e->start != HOLE_SECTOR)
+      return false;
+    index = first + e->length;
+  }
+  return true;
+}
+
+/* Returns whether data sector INDEX of INODE is delayed. */
+static bool delay_has(const struct inode *inode, off_t index) {
+  return inode->delay_cnt > 0 && index >= inode->delay_first &&
+         index < inode->delay_first + (off_t)inode->delay_cnt;
+}
+
+/* Gives INODE a buffer for delayed sectors, and reserves the
+   overflow blocks they may need.  Returns false if DELAY_INODES
+   inodes have one already, or memory or disk space runs out. */
+static bool delay_start(struct inode *inode) {
+  bool success = false;
+
+  if (!free_map_reserve(DELAY_META_SECTORS))
+    return false;
+  lock_acquire(&delay_lock);
+  if (list_size(&delayed_inodes) < DELAY_INODES) {
+    inode->delay_buf = palloc_get_multiple(0, DELAY_PAGES);
+    if (inode->delay_buf != NULL) {
+      inode->delay_cnt = 0;
+      inode->delay_since = timer_ticks();
+      list_push_back(&delayed_inodes, &inode->delay_elem);
+      success = true;
+    }
+  }
+  lock_release(&delay_lock);
+  if (!success)
+    free_map_unreserve(DELAY_META_SECTORS);
+  return success;
+}
+
+/* Drops INODE's buffer of delayed sectors, which have been
+   written back or are not wanted any more, and gives back their
+   reservation. */
+static void delay_stop(struct inode *inode) {
+  if (inode->delay_buf == NULL)
+    return;
+
+  free_map_unreserve(inode->delay_cnt + DELAY_META_SECTORS);
+  lock_acquire(&delay_lock);
+  list_remove(&inode->delay_elem);
+  lock_release(&delay_lock);
+  palloc_free_multiple(inode->delay_buf, DELAY_PAGES);
+  inode->delay_buf = NULL;
+  inode->delay_cnt = 0;
+}
+
+/* Copies a write of SIZE bytes from BUFFER at OFFSET into INODE's
+   delayed sectors instead of allocating disk sectors for it, if
+   the write lies in holes and starts within or right after the
+   delayed sectors, or starts them if there are none, and they stay
+   within DELAY_SECTORS.  Returns whether it did.  The caller must
+   hold INODE's rwlock for writing. */
+static bool delay_write(struct inode *inode, const void *buffer, off_t size,
+                        off_t offset) {
+  off_t first = offset / BLOCK_SECTOR_SIZE;
+  off_t end = DIV_ROUND_UP(offset + size, BLOCK_SECTOR_SIZE);
+  off_t run_end = inode->delay_first + inode->delay_cnt;
+  off_t start = first;
+
+  if (!uses_extents(&inode->data) || inode_hint(inode) != CACHE_DATA)
+    return false;
+  if (inode->delay_cnt > 0) {
+    if (first < inode->delay_first || first > run_end ||
+        end - inode->delay_first > DELAY_SECTORS)
+      return false;
+    start = run_end;
+  } else if (end - first > DELAY_SECTORS)
+    return false;
+
+  // The sectors not delayed yet must be holes, and must fit, with
+  // room for the extents they will take
+  size_t new_cnt = end > start ? end - start : 0;
+  if (new_cnt > 0 && (!extent_all_holes(inode, start, end) ||
+                      !extent_room(inode, DELAY_EXTENTS(inode) + 2 * new_cnt)))
+    return false;
+  if (inode->delay_buf == NULL && !delay_start(inode))
+    return false;
+  if (!free_map_reserve(new_cnt)) {
+    if (inode->delay_cnt == 0)
+      delay_stop(inode);
+    return false;
+  }
+
+  if (inode->delay_cnt == 0)
+    inode->delay_first = first;
+  memset(inode->delay_buf + (start - inode->delay_first) * BLOCK_SECTOR_SIZE,
+         0, new_cnt * BLOCK_SECTOR_SIZE);
+  inode->delay_cnt += new_cnt;
+  memcpy(inode->delay_buf + (offset - inode->delay_first * BLOCK_SECTOR_SIZE),
+         buffer, size);
+  return true;
+}
+
+/* Allocates disk sectors for INODE's delayed sectors, in as few
+   runs as the free map allows, and moves their data into the
+   cache.  The caller must hold INODE's rwlock for writing, in a
+   journal handle.  The reservation in the free map and the room
+   that delay_write() made for the extents mean that every sector
+   gets one. */
+static void delay_flush(struct inode *inode) {
+  if (inode->delay_cnt > 0) {
+    if (!extent_fill(inode, inode->delay_first * BLOCK_SECTOR_SIZE,
+                     inode->delay_cnt * BLOCK_SECTOR_SIZE, FILL_DELAYED))
+      PANIC("can't write back delayed sectors");
+    for (size_t k = 0; k < inode->delay_cnt; k++)
+      cache_write(extent_lookup(inode, inode->delay_first + k),
+                  inode->delay_buf + k * BLOCK_SECTOR_SIZE, CACHE_DATA);
+  }
+  delay_stop(inode);
 }
 
 /* Returns the block device sector that contains the data
-   at index INDEX within INODE.
+   at index INDEX within INODE, or HOLE_SECTOR if it is in a hole.
    Returns -1 if INDEX is out of bounds. */
-static block_sector_t index_to_sector(const struct inode_disk *idisk,
-                                      off_t index) {
+static block_sector_t index_to_sector(struct inode *inode, off_t index) {
+  if (uses_extents(&inode->data))
+    return extent_lookup(inode, index);
+
   // Direct
-  off_t index_base = 0, index_limit = DIRECT_BLOCKS_COUNT;
+  off_t index_limit = DIRECT_BLOCKS_COUNT;
   if (index < index_limit)
-    return index_direct(idisk, index);
+    return index_direct(&inode->data, index);
 
   // Indirect block
-  index_base = index_limit;
   index_limit += INDIRECT_BLOCKS_PER_SECTOR;
   if (index < index_limit)
-    return index_indirect(idisk, index - index_base);
+    return index_indirect(inode, index);
 
   // Doubly indirect block
-  index_base = index_limit;
   index_limit += DOUBLY_INDIRECT_BLOCKS_PER_SECTOR;
   if (index < index_limit)
-    return index_doubly_indirect(idisk, index - index_base);
+    return index_doubly_indirect(inode, index);
 
   // Out of bounds
   ASSERT(false);
@@ -137,7 +966,7 @@ static block_sector_t index_to_sector(const struct inode_disk *idisk,
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
-static block_sector_t byte_to_sector(const struct inode *inode, off_t pos) {
+static block_sector_t byte_to_sector(struct inode *inode, off_t pos) {
   ASSERT(inode != NULL);
   if (pos < 0) {
     // negative offset: no sector
@@ -147,17 +976,51 @@ static block_sector_t byte_to_sector(const struct inode *inode, off_t pos) {
   if (pos < inode->data.length) {
     // sector index
     off_t index = pos / BLOCK_SECTOR_SIZE;
-    return index_to_sector(&inode->data, index);
+    return index_to_sector(inode, index);
   } else
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  Protected by
+   open_inodes_lock. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+/* Hash function for open_inodes. */
+static unsigned inode_hash(const struct hash_elem *e, void *aux UNUSED) {
+  return hash_int(hash_entry(e, struct inode, elem)->sector);
+}
+
+/* Hash less func for open_inodes. */
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b,
+                       void *aux UNUSED) {
+  return hash_entry(a, struct inode, elem)->sector <
+         hash_entry(b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
-void inode_init(void) { list_init(&open_inodes); }
+void inode_init(void) {
+  if (!hash_init(&open_inodes, inode_hash, inode_less, NULL))
+    PANIC("open inode table creation failed");
+  lock_init(&open_inodes_lock);
+  list_init(&delayed_inodes);
+  lock_init(&delay_lock);
+  cache_set_flush_hook(inode_flush_delayed);
+}
+
+/* Returns the open inode for SECTOR, or a null pointer if it is
+   not open.  The caller must hold open_inodes_lock. */
+static struct inode *inode_find(block_sector_t sector) {
+  /* Only the key is looked at; static, which open_inodes_lock
+     makes safe, to keep the inode's copy of its disk inode off the
+     stack. */
+  static struct inode key;
+  key.sector = sector;
+
+  struct hash_elem *e = hash_find(&open_inodes, &key.elem);
+  return e == NULL ? NULL : hash_entry(e, struct inode, elem);
+}
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
@@ -166,25 +1029,37 @@ void inode_init(void) { list_init(&open_inodes); }
    Returns false if memory or disk allocation fails. */
 bool inode_create(block_sector_t sector, off_t length, bool is_dir) {
   struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode;
+  bool success;
 
   ASSERT(length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct extent_block) == BLOCK_SECTOR_SIZE);
 
+  /* Write an empty inode, then grow it like a write would. */
   disk_inode = calloc(1, sizeof *disk_inode);
-  if (disk_inode != NULL) {
-    disk_inode->length = length;
-    disk_inode->magic = INODE_MAGIC;
-    disk_inode->is_dir = is_dir;
-    if (inode_allocate_sector(disk_inode, length)) {
-      cache_write(sector, disk_inode);
-      success = true;
-    }
-    free(disk_inode);
-  }
+  if (disk_inode == NULL)
+    return false;
+  disk_inode->magic = is_dir ? INODE_EXTENT_MAGIC : INODE_INLINE_MAGIC;
+  disk_inode->is_dir = is_dir;
+  cache_write(sector, disk_inode, CACHE_META);
+  free(disk_inode);
+
+  if (length == 0)
+    return true;
+
+  inode = inode_open(sector);
+  if (inode == NULL)
+    return false;
+  rwlock_acquire_write(&inode->rwlock);
+  success = inode_extend(inode, length);
+  if (!success)
+    inode_deallocate(inode);
+  rwlock_release_write(&inode->rwlock);
+  inode_close(inode);
   return success;
 }
 
@@ -192,39 +1067,72 @@ bool inode_create(block_sector_t sector, off_t length, bool is_dir) {
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *inode_open(block_sector_t sector) {
-  struct list_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-       e = list_next(e)) {
-    inode = list_entry(e, struct inode, elem);
-    if (inode->sector == sector) {
-      inode_reopen(inode);
-      return inode;
-    }
+  /* Check whether this inode is already open.  If not, read it
+     with open_inodes_lock still held, so that nobody opens and
+     changes it before it is in open_inodes. */
+  lock_acquire(&open_inodes_lock);
+  inode = inode_find(sector);
+  if (inode != NULL) {
+    inode->open_cnt++;
+    goto done;
   }
 
   /* Allocate memory. */
   inode = malloc(sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    goto done;
 
   /* Initialize. */
-  list_push_front(&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->metadata = false;
+  inode->ra_next = inode->ra_end = 0;
+  inode->ra_window = 0;
+  for (int i = 0; i < BLOCK_MAP_SLOTS; i++)
+    inode->maps[i] = NULL;
+  inode->map_last = 0;
+  inode->more_extents = NULL;
+  inode->more_cap = 0;
+  inode->ext_blocks = NULL;
+  inode->ext_block_cnt = 0;
+  inode->ext_dirty = SIZE_MAX;
+  inode->ext_sectors = 0;
+  inode->ext_allocated = 0;
+  inode->ext_cursor = 0;
+  inode->ext_cursor_first = 0;
+  inode->delay_buf = NULL;
+  inode->delay_first = 0;
+  inode->delay_cnt = 0;
+  rwlock_init(&inode->rwlock);
+  lock_init(&inode->state_lock);
+  lock_init(&inode->lock);
+
+  cache_read(inode->sector, &inode->data, CACHE_META);
+  if (uses_extents(&inode->data) && !extent_load(inode)) {
+    free(inode->more_extents);
+    free(inode->ext_blocks);
+    free(inode);
+    inode = NULL;
+    goto done;
+  }
+  hash_insert(&open_inodes, &inode->elem);
 
-  cache_read(inode->sector, &inode->data);
+done:
+  lock_release(&open_inodes_lock);
   return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode *inode_reopen(struct inode *inode) {
-  if (inode != NULL)
+  if (inode != NULL) {
+    lock_acquire(&open_inodes_lock);
     inode->open_cnt++;
+    lock_release(&open_inodes_lock);
+  }
   return inode;
 }
 
@@ -237,21 +1145,54 @@ block_sector_t inode_get_inumber(const struct inode *inode) {
    If this was the last reference to INODE, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
 void inode_close(struct inode *inode) {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0) {
-    /* Remove from inode list and release lock. */
-    list_remove(&inode->elem);
-
-    /* Deallocate blocks if removed. */
+  /* The last opener writes back delayed sectors while INODE is
+     still in open_inodes, so that an inode_open() meanwhile finds
+     it rather than reading the inode from disk before they have
+     sectors.  Whoever opens it then may delay more, so check
+     again afterward. */
+  lock_acquire(&open_inodes_lock);
+  while (inode->open_cnt == 1 && inode->delay_buf != NULL &&
+         !inode->removed) {
+    lock_release(&open_inodes_lock);
+    journal_begin();
+    rwlock_acquire_write(&inode->rwlock);
+    delay_flush(inode);
+    rwlock_release_write(&inode->rwlock);
+    journal_end();
+    lock_acquire(&open_inodes_lock);
+  }
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete(&open_inodes, &inode->elem);
+  lock_release(&open_inodes_lock);
+
+  /* Release resources if this was the last opener, which leaves
+     nobody else to lock out. */
+  if (last) {
+    /* Drop the delayed sectors of a removed inode, which nobody
+       will read. */
+    delay_stop(inode);
+
+    /* Deallocate blocks if removed, in one transaction. */
     if (inode->removed) {
+      journal_begin();
+      free_map_batch_begin();
       free_map_release(inode->sector, 1);
       inode_deallocate(inode);
+      free_map_batch_end();
+      journal_end();
     }
 
+    for (int i = 0; i < BLOCK_MAP_SLOTS; i++)
+      free(inode->maps[i]);
+    free(inode->more_extents);
+    free(inode->ext_blocks);
     free(inode);
   }
 }
@@ -260,7 +1201,91 @@ void inode_close(struct inode *inode) {
    has it open. */
 void inode_remove(struct inode *inode) {
   ASSERT(inode != NULL);
+  lock_acquire(&open_inodes_lock);
   inode->removed = true;
+  lock_release(&open_inodes_lock);
+}
+
+/* Writes back the delayed sectors of every inode that has had
+   them for at least AGE timer ticks.  The write-behind daemon
+   calls this before each round. */
+void inode_flush_delayed(int64_t age) {
+  while (true) {
+    struct inode *inode = NULL;
+    int64_t now = timer_ticks();
+
+    /* Removed inodes whose last opener is closing them are left
+       to it. */
+    lock_acquire(&open_inodes_lock);
+    lock_acquire(&delay_lock);
+    for (struct list_elem *e = list_begin(&delayed_inodes);
+         e != list_end(&delayed_inodes); e = list_next(e)) {
+      struct inode *i = list_entry(e, struct inode, delay_elem);
+      if (i->open_cnt > 0 && now - i->delay_since >= age) {
+        inode = i;
+        inode->open_cnt++;
+        break;
+      }
+    }
+    lock_release(&delay_lock);
+    lock_release(&open_inodes_lock);
+    if (inode == NULL)
+      return;
+
+    journal_begin();
+    rwlock_acquire_write(&inode->rwlock);
+    delay_flush(inode);
+    rwlock_release_write(&inode->rwlock);
+    journal_end();
+    inode_close(inode);
+  }
+}
+
+/* Acquires INODE's own lock, with which callers that make one
+   operation out of several reads and writes of INODE, such as
+   directory updates, keep each other out.  Reads and writes of
+   INODE do not take it themselves. */
+void inode_lock(struct inode *inode) { lock_acquire(&inode->lock); }
+
+/* Releases INODE's own lock. */
+void inode_unlock(struct inode *inode) { lock_release(&inode->lock); }
+
+/* Updates INODE's sequential read detection for a read of SIZE
+   bytes at OFFSET, and queues read-ahead of the sectors that
+   follow it if reads of INODE look sequential.  The window starts
+   at READ_AHEAD_MIN sectors and doubles with each sequential read
+   up to READ_AHEAD_MAX; any other access closes it. */
+static void inode_read_ahead(struct inode *inode, off_t offset, off_t size) {
+  off_t first = offset / BLOCK_SECTOR_SIZE;
+  off_t next = (offset + size) / BLOCK_SECTOR_SIZE;
+
+  if (first == inode->ra_next && size > 0) {
+    if (inode->ra_window == 0)
+      inode->ra_window = READ_AHEAD_MIN;
+    else if (inode->ra_window < READ_AHEAD_MAX)
+      inode->ra_window *= 2;
+  } else {
+    inode->ra_window = 0;
+    inode->ra_end = 0;
+  }
+  inode->ra_next = next;
+
+  if (inode->ra_window == 0)
+    return;
+
+  off_t limit = next + inode->ra_window;
+  off_t length_sectors = bytes_to_sectors(inode_length(inode));
+  if (limit > length_sectors)
+    limit = length_sectors;
+
+  off_t index = inode->ra_end > next ? inode->ra_end : next;
+  for (; index < limit; index++) {
+    block_sector_t sector = index_to_sector(inode, index);
+    if (sector != HOLE_SECTOR)
+      read_ahead(sector);
+  }
+  if (index > inode->ra_end)
+    inode->ra_end = index;
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -270,11 +1295,23 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
                     off_t offset) {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+
+  rwlock_acquire_read(&inode->rwlock);
+  if (is_inline(&inode->data)) {
+    // Straight out of the in-memory inode.
+    if (offset < inode_length(inode) && size > 0) {
+      bytes_read = min(size, inode_length(inode) - offset);
+      memcpy(buffer, inode->data.inline_data + offset, bytes_read);
+    }
+    rwlock_release_read(&inode->rwlock);
+    return bytes_read;
+  }
 
   while (size > 0) {
     /* Disk sector to read, starting byte offset within sector. */
+    lock_acquire(&inode->state_lock);
     block_sector_t sector_idx = byte_to_sector(inode, offset);
+    lock_release(&inode->state_lock);
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
     /* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -287,52 +1324,115 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-      /* Read full sector directly into caller's buffer. */
-      cache_read(sector_idx, buffer + bytes_read);
-    } else {
-      /* Read sector into bounce buffer, then partially copy
-         into caller's buffer. */
-      if (bounce == NULL) {
-        bounce = malloc(BLOCK_SECTOR_SIZE);
-        if (bounce == NULL)
-          break;
-      }
-      cache_read(sector_idx, bounce);
-      memcpy(buffer + bytes_read, bounce + sector_ofs, chunk_size);
-    }
+    /* Copy straight out of the cached sector.  A hole has no
+       sector and reads as zeros, unless it is delayed. */
+    if (sector_idx == HOLE_SECTOR &&
+        delay_has(inode, offset / BLOCK_SECTOR_SIZE))
+      memcpy(buffer + bytes_read,
+             inode->delay_buf +
+                 (offset - inode->delay_first * BLOCK_SECTOR_SIZE),
+             chunk_size);
+    else if (sector_idx == HOLE_SECTOR)
+      memset(buffer + bytes_read, 0, chunk_size);
+    else
+      cache_read_at(sector_idx, sector_ofs, chunk_size, buffer + bytes_read,
+                    inode_hint(inode));
 
     /* Advance. */
     size -= chunk_size;
     offset += chunk_size;
     bytes_read += chunk_size;
   }
-  free(bounce);
 
+  lock_acquire(&inode->state_lock);
+  inode_read_ahead(inode, offset - bytes_read, bytes_read);
+  lock_release(&inode->state_lock);
+  rwlock_release_read(&inode->rwlock);
   return bytes_read;
 }
 
+/* Returns whether a write of SIZE bytes at OFFSET changes the
+   layout of INODE, by extending it, by filling a hole or by
+   writing unwritten sectors.  The caller must hold INODE's rwlock
+   for writing. */
+static bool inode_write_grows(struct inode *inode, off_t offset,
+                              off_t size) {
+  off_t index = offset / BLOCK_SECTOR_SIZE;
+  off_t end = DIV_ROUND_UP(offset + size, BLOCK_SECTOR_SIZE);
+
+  if (offset + size > inode_length(inode))
+    return true;
+  if (!uses_extents(&inode->data))
+    return false;
+  while (index < end) {
+    off_t first;
+    struct extent *e = extent_at(inode, extent_find(inode, index, &first));
+    if (e->start == HOLE_SECTOR || extent_unwritten(e))
+      return true;
+    index = first + e->length;
+  }
+  return false;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
-   A write at end of file would extend the inode.
+   A write at end of file would extend the inode, moving the data
+   of an inline inode out to a data sector if it no longer fits.
+   Any holes the write falls in get their disk sectors first, or
+   are delayed.  Such changes to the inode go in a journal handle.
    */
 off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
                      off_t offset) {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
-
-  if (inode->deny_write_cnt)
-    return 0;
+  off_t old_length;
+  bool handle = false;
+
+  rwlock_acquire_write(&inode->rwlock);
+  if (inode->deny_write_cnt || size <= 0)
+    goto done;
+
+  // Opening a handle may wait for a commit, so not with the lock
+  if (inode_write_grows(inode, offset, size)) {
+    rwlock_release_write(&inode->rwlock);
+    journal_begin();
+    handle = true;
+    rwlock_acquire_write(&inode->rwlock);
+    if (inode->deny_write_cnt)
+      goto done;
+  }
+  old_length = inode_length(inode);
 
   // Extend the file
-  if (byte_to_sector(inode, offset + size - 1) == -1u) {
-    if (!inode_allocate_sector(&inode->data, offset + size))
-      return 0;
+  if (offset + size > old_length && !inode_extend(inode, offset + size))
+    goto done;
+
+  // Small enough to stay in the inode
+  if (is_inline(&inode->data)) {
+    memcpy(inode->data.inline_data + offset, buffer, size);
+    cache_write(inode->sector, &inode->data, CACHE_META);
+    bytes_written = size;
+    goto done;
+  }
 
-    inode->data.length = offset + size;
-    cache_write(inode->sector, &inode->data);
+  // Delay allocating the holes written to, or else allocate the
+  // delayed sectors first, which keeps them where they belong
+  if (delay_write(inode, buffer, size, offset)) {
+    bytes_written = size;
+    goto done;
+  }
+  if (inode->delay_cnt > 0 && inode_write_grows(inode, offset, size))
+    delay_flush(inode);
+
+  // Allocate the holes written to, or undo the extension
+  if (uses_extents(&inode->data) &&
+      !extent_fill(inode, offset, size, FILL_WRITE)) {
+    if (inode_length(inode) != old_length) {
+      inode->data.length = old_length;
+      cache_write(inode->sector, &inode->data, CACHE_META);
+    }
+    goto done;
   }
 
   while (size > 0) {
@@ -350,57 +1450,104 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-      /* Write full sector directly to disk. */
-      cache_write(sector_idx, buffer + bytes_written);
-    } else {
-      /* We need a bounce buffer. */
-      if (bounce == NULL) {
-        bounce = malloc(BLOCK_SECTOR_SIZE);
-        if (bounce == NULL)
-          break;
-      }
-
-      /* If the sector contains data before or after the chunk
-         we're writing, then we need to read in the sector
-         first.  Otherwise we start with a sector of all zeros. */
-      if (sector_ofs > 0 || chunk_size < sector_left)
-        cache_read(sector_idx, bounce);
-      else
-        memset(bounce, 0, BLOCK_SECTOR_SIZE);
-      memcpy(bounce + sector_ofs, buffer + bytes_written, chunk_size);
-      cache_write(sector_idx, bounce);
-    }
+    /* Copy straight into the cached sector, which the cache
+       reads in first if the chunk does not cover all of it. */
+    cache_write_at(sector_idx, sector_ofs, chunk_size, buffer + bytes_written,
+                   inode_hint(inode));
 
     /* Advance. */
     size -= chunk_size;
     offset += chunk_size;
     bytes_written += chunk_size;
   }
-  free(bounce);
 
+done:
+  rwlock_release_write(&inode->rwlock);
+  if (handle)
+    journal_end();
   return bytes_written;
 }
 
+/* Allocates disk sectors for the LENGTH bytes of INODE starting at
+   OFFSET, extending INODE if they go past its end, so that later
+   writes there need not allocate and land on sectors laid out in
+   file order.  The sectors are not zeroed: they read as zeros
+   until they are first written.  Returns false if the disk is
+   full, in which case INODE keeps its length but may keep some of
+   the sectors, or if writes to INODE are denied. */
+bool inode_allocate(struct inode *inode, off_t offset, off_t length) {
+  off_t old_length;
+  bool success = false;
+
+  if (offset < 0 || length <= 0 || length > INT32_MAX - offset)
+    return false;
+
+  journal_begin();
+  rwlock_acquire_write(&inode->rwlock);
+  if (inode->deny_write_cnt)
+    goto done;
+  old_length = inode_length(inode);
+  if (offset + length > old_length && !inode_extend(inode, offset + length))
+    goto done;
+  success = true;
+
+  // Inline and indexed inodes are allocated as they are extended
+  if (uses_extents(&inode->data)) {
+    if (inode->delay_cnt > 0)
+      delay_flush(inode);
+    success = extent_fill(inode, offset, length, FILL_PREALLOC);
+    if (!success && inode_length(inode) != old_length) {
+      inode->data.length = old_length;
+      cache_write(inode->sector, &inode->data, CACHE_META);
+    }
+  }
+
+done:
+  rwlock_release_write(&inode->rwlock);
+  journal_end();
+  return success;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void inode_deny_write(struct inode *inode) {
+  rwlock_acquire_write(&inode->rwlock);
   inode->deny_write_cnt++;
   ASSERT(inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write(&inode->rwlock);
 }
 
 /* Re-enables writes to INODE.
    Must be called once by each inode opener who has called
    inode_deny_write() on the inode, before closing the inode. */
 void inode_allow_write(struct inode *inode) {
+  rwlock_acquire_write(&inode->rwlock);
   ASSERT(inode->deny_write_cnt > 0);
   ASSERT(inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write(&inode->rwlock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t inode_length(const struct inode *inode) { return inode->data.length; }
 
+/* Returns the number of data sectors allocated to INODE, which is
+   less than its length in sectors if it has holes, and 0 if its
+   data is inline.  Delayed sectors count as allocated. */
+size_t inode_allocated_sectors(struct inode *inode) {
+  size_t cnt;
+
+  rwlock_acquire_read(&inode->rwlock);
+  if (uses_extents(&inode->data))
+    cnt = inode->ext_allocated + inode->delay_cnt;
+  else if (is_inline(&inode->data))
+    cnt = 0;
+  else
+    cnt = bytes_to_sectors(inode->data.length);
+  rwlock_release_read(&inode->rwlock);
+  return cnt;
+}
+
 /* Returns true if the block is free, false otherwise */
 static bool block_is_free(block_sector_t sector) { return sector == 0; }
 
@@ -411,7 +1558,7 @@ static bool inode_allocate_sector_direct(block_sector_t *entry) {
   if (block_is_free(*entry)) {
     if (!free_map_allocate(1, entry))
       return false;
-    cache_write(*entry, zeros);
+    cache_write(*entry, zeros, CACHE_DATA);
   }
   return true;
 }
@@ -428,10 +1575,10 @@ static bool inode_allocate_sector_indirect(block_sector_t *entry,
   struct inode_indirect_block_sector indirect_block;
   if (block_is_free(*entry)) {
     free_map_allocate(1, entry);
-    cache_write(*entry, zeros);
+    cache_write(*entry, zeros, CACHE_META);
   }
 
-  cache_read(*entry, &indirect_block);
+  cache_read(*entry, &indirect_block, CACHE_META);
 
   size_t l = num_sectors;
   if (level > 1)
@@ -448,7 +1595,7 @@ static bool inode_allocate_sector_indirect(block_sector_t *entry,
     num_sectors -= subsize;
   }
 
-  cache_write(*entry, &indirect_block);
+  cache_write(*entry, &indirect_block, CACHE_META);
   return true;
 }
 
@@ -490,6 +1637,32 @@ static bool inode_allocate_sector(struct inode_disk *disk_inode, off_t length) {
   return false;
 }
 
+/* Grows INODE to LENGTH bytes and writes its inode sector.  An
+   inline inode stays inline if LENGTH fits.  With extents the new
+   data sectors are a hole; otherwise they are allocated and
+   zeroed.  Returns false if the disk is full, in which case the
+   length does not change.  The caller must hold INODE's rwlock
+   for writing. */
+static bool inode_extend(struct inode *inode, off_t length) {
+  bool success = true;
+
+  ASSERT(rwlock_held_for_write(&inode->rwlock));
+  block_map_invalidate(inode);
+  free_map_batch_begin();
+  if (is_inline(&inode->data) && length > INODE_INLINE_BYTES)
+    success = inline_spill(inode);
+  if (success && uses_extents(&inode->data))
+    success = extent_grow(inode, bytes_to_sectors(length));
+  else if (success && !is_inline(&inode->data))
+    success = inode_allocate_sector(&inode->data, length);
+  free_map_batch_end();
+
+  if (success)
+    inode->data.length = length;
+  cache_write(inode->sector, &inode->data, CACHE_META);
+  return success;
+}
+
 /* Helper function for deallocating blocks for an inode.
    Returns true if successful, false otherwise. */
 static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
@@ -500,7 +1673,7 @@ static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
   }
 
   struct inode_indirect_block_sector indirect_block;
-  cache_read(entry, &indirect_block);
+  cache_read(entry, &indirect_block, CACHE_META);
 
   size_t l = num_sectors;
   if (level > 1)
@@ -517,6 +1690,13 @@ static void inode_deallocate_indirect(block_sector_t entry, size_t num_sectors,
 }
 
 static bool inode_deallocate(struct inode *inode) {
+  if (uses_extents(&inode->data)) {
+    extent_release(inode);
+    return true;
+  }
+  if (is_inline(&inode->data))
+    return true;
+
   off_t file_length = inode->data.length;
   if (file_length < 0)
     return false;
@@ -17,11 +17,19 @@ void inode_close(struct inode *);
 void inode_remove(struct inode *);
 off_t inode_read_at(struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at(struct inode *, const void *, off_t size, off_t offset);
+bool inode_allocate(struct inode *, off_t offset, off_t length);
 void inode_deny_write(struct inode *);
 void inode_allow_write(struct inode *);
 off_t inode_length(const struct inode *);
+size_t inode_allocated_sectors(struct inode *);
+void inode_flush_delayed(int64_t age);
+
+void inode_lock(struct inode *);
+void inode_unlock(struct inode *);
 
 bool inode_is_directory(const struct inode *inode);
+bool inode_sector_is_directory(block_sector_t);
 bool inode_is_removed(const struct inode *inode);
+void inode_set_metadata(struct inode *inode);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,486 @@
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Metadata journal.
+
+   Changes to file system metadata (inodes, extent and indirect
+   blocks, directories, their indexes and the free map) reach the
+   disk through the log first.  The buffer cache tags each
+   metadata sector written with the running transaction and holds
+   it back until the transaction is committed.  A commit copies
+   the sectors of the transaction into the log in one sequential
+   write, after a descriptor that lists their home sectors and
+   before a commit sector that checksums them all.  Then they may
+   go home in the background.  Once more than half of the log is
+   in use, a checkpoint writes everything home and empties it.
+   Mounting replays the complete transactions left in the log, so
+   after an unclean shutdown the metadata is as of the last commit
+   without looking at the rest of the disk.  File data is not
+   journaled.
+
+   Operations whose changes belong together, such as creating a
+   file, run in a handle, between journal_begin() and
+   journal_end().  A commit waits for the open handles to end and
+   holds off new ones until it is done, so it takes every
+   operation that ended since the last commit, from all threads,
+   in one log write.  The journal daemon commits every
+   JOURNAL_COMMIT_MS, and a handle that finds COMMIT_SECTORS
+   sectors waiting, or a quarter of a smaller cache, commits them
+   before it opens, so that the cache keeps room for entries it
+   may write back. */
+
+#define JOURNAL_COMMIT_MS 100
+#define COMMIT_SECTORS (JOURNAL_LOG_SECTORS / 8)
+
+/* Log sectors, after the header. */
+#define LOG_START (JOURNAL_SECTOR + 1)
+
+/* Most sectors in one transaction.  A transaction fits in the
+   half of the log that a checkpoint leaves free. */
+#define TXN_SECTORS (JOURNAL_LOG_SECTORS / 2 - 2)
+
+/* Identify the sectors of the journal. */
+#define JOURNAL_MAGIC 0x4a524e4c
+#define DESC_MAGIC 0x4a445343
+#define COMMIT_MAGIC 0x4a434d54
+
+/* Journal header.  The log holds transactions SEQ, SEQ + 1, ...
+   one after the other from its start, up to the first that is not
+   complete. */
+struct journal_header {
+  uint32_t magic; /* JOURNAL_MAGIC. */
+  uint32_t seq;   /* Number of the first transaction in the log. */
+  uint32_t unused[126];
+};
+
+/* First sector of a transaction, followed by BLOCK_CNT sectors to
+   copy home and a struct journal_commit.
+
+   A sector freed by the transaction may be reused for file data,
+   which an older copy of the sector in the log must not overwrite
+   on replay.  So the descriptor also lists REVOKE_CNT runs of
+   sectors that the transaction freed, and replay skips the copies
+   that earlier transactions logged of them.  ENTRIES holds the
+   home sector of each logged sector, then the first sector and
+   length of each run. */
+#define DESC_ENTRIES 124
+struct journal_desc {
+  uint32_t magic;      /* DESC_MAGIC. */
+  uint32_t seq;        /* Transaction number. */
+  uint32_t block_cnt;  /* Number of sectors logged. */
+  uint32_t revoke_cnt; /* Number of runs freed. */
+  block_sector_t entries[DESC_ENTRIES];
+};
+
+/* Last sector of a transaction. */
+struct journal_commit {
+  uint32_t magic;    /* COMMIT_MAGIC. */
+  uint32_t seq;      /* Transaction number. */
+  uint32_t checksum; /* hash_bytes() of the descriptor and blocks. */
+  uint32_t unused[125];
+};
+
+/* A run of sectors freed by the running transaction. */
+struct revoke {
+  block_sector_t start;
+  uint32_t cnt;
+};
+
+/* Runs a transaction can free. */
+#define REVOKE_MAX (DESC_ENTRIES / 2)
+
+static bool journal_on;       /* False if the disk has no journal. */
+static size_t commit_sectors; /* Sectors waiting that make a commit. */
+
+/* State of the running transaction, protected by journal_lock.
+   JOURNAL_COND is signalled when the last handle ends and when a
+   commit is done. */
+static struct lock journal_lock;
+static struct condition journal_cond;
+static int handle_cnt;                    /* Outermost handles open. */
+static bool committing;                   /* A commit is in progress. */
+static struct revoke revokes[REVOKE_MAX]; /* Runs freed... */
+static size_t revoke_cnt;                 /* ...and their number... */
+static bool revoke_overflow;              /* ...or too many. */
+static struct bitmap *logged;             /* Sectors in the log. */
+
+/* Log state, owned by the committing thread. */
+static uint32_t next_seq; /* Number of the next transaction. */
+static size_t log_used;   /* Log sectors in use. */
+static uint8_t *staging;  /* A transaction, as written to the log. */
+#define STAGING_PAGES                                                          \
+  DIV_ROUND_UP((TXN_SECTORS + 2) * BLOCK_SECTOR_SIZE, PGSIZE)
+
+static thread_func journal_daemon;
+static uint32_t replay(uint32_t seq);
+static void checkpoint(void);
+
+/* Writes the journal header, for a log whose first transaction is
+   SEQ. */
+static void write_header(uint32_t seq) {
+  static struct journal_header h;
+
+  h.magic = JOURNAL_MAGIC;
+  h.seq = seq;
+  block_write(fs_device, JOURNAL_SECTOR, &h);
+}
+
+/* Writes an empty journal, while formatting.  free_map_init()
+   keeps its sectors in use. */
+void journal_create(void) {
+  if (block_size(fs_device) >= JOURNAL_MIN_DISK)
+    write_header(1);
+}
+
+/* Opens the journal, replays the transactions in its log and
+   starts journaling, if the disk has a journal.  Must be called
+   before anything reads metadata. */
+void journal_init(void) {
+  static struct journal_header h;
+
+  ASSERT(sizeof h == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct journal_desc) == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct journal_commit) == BLOCK_SECTOR_SIZE);
+
+  lock_init(&journal_lock);
+  cond_init(&journal_cond);
+  handle_cnt = 0;
+  committing = false;
+  revoke_cnt = 0;
+  revoke_overflow = false;
+  journal_on = false;
+
+  if (block_size(fs_device) < JOURNAL_MIN_DISK)
+    return;
+  block_read(fs_device, JOURNAL_SECTOR, &h);
+  if (h.magic != JOURNAL_MAGIC) {
+    printf("filesys: no journal, metadata is written in place\n");
+    return;
+  }
+
+  staging = palloc_get_multiple(0, STAGING_PAGES);
+  logged = bitmap_create(block_size(fs_device));
+  if (staging == NULL || logged == NULL)
+    PANIC("can't allocate journal");
+
+  commit_sectors = cache_get_size() / 4;
+  if (commit_sectors > COMMIT_SECTORS)
+    commit_sectors = COMMIT_SECTORS;
+
+  next_seq = replay(h.seq);
+  write_header(next_seq);
+  log_used = 0;
+
+  cache_journal_start();
+  journal_on = true;
+  thread_create("journal", PRI_DEFAULT, journal_daemon, NULL);
+}
+
+/* Commits what is left, writes everything home and empties the
+   log, at shutdown. */
+void journal_done(void) {
+  if (!journal_on)
+    return;
+
+  journal_commit();
+  lock_acquire(&journal_lock);
+  while (committing)
+    cond_wait(&journal_cond, &journal_lock);
+  journal_on = false;
+  lock_release(&journal_lock);
+
+  checkpoint();
+  palloc_free_multiple(staging, STAGING_PAGES);
+  bitmap_destroy(logged);
+}
+
+/* Opens a handle: changes made until the matching journal_end()
+   are committed together.  Handles nest.  Opening the outermost
+   one may wait for a commit, which waits for the other handles to
+   end, so it must not be opened while holding a lock that an
+   operation in a handle may need. */
+void journal_begin(void) {
+  if (thread_current()->journal_depth++ > 0 || !journal_on)
+    return;
+
+  if (cache_journal_pending() >= commit_sectors)
+    journal_commit();
+
+  lock_acquire(&journal_lock);
+  while (committing)
+    cond_wait(&journal_cond, &journal_lock);
+  handle_cnt++;
+  lock_release(&journal_lock);
+}
+
+/* Closes a handle opened by journal_begin(). */
+void journal_end(void) {
+  struct thread *t = thread_current();
+
+  ASSERT(t->journal_depth > 0);
+  if (--t->journal_depth > 0 || !journal_on)
+    return;
+
+  lock_acquire(&journal_lock);
+  if (--handle_cnt == 0)
+    cond_broadcast(&journal_cond, &journal_lock);
+  lock_release(&journal_lock);
+}
+
+/* Makes the running transaction revoke the copies the log holds
+   of the CNT sectors starting at SECTOR, if any.  Must be called
+   with journal_lock held. */
+static void add_revoke(block_sector_t sector, size_t cnt) {
+  ASSERT(lock_held_by_current_thread(&journal_lock));
+
+  if (bitmap_any(logged, sector, cnt)) {
+    bitmap_set_multiple(logged, sector, cnt, false);
+    if (revoke_cnt < REVOKE_MAX) {
+      revokes[revoke_cnt].start = sector;
+      revokes[revoke_cnt].cnt = cnt;
+      revoke_cnt++;
+    } else
+      revoke_overflow = true;
+  }
+}
+
+/* Notes that the CNT sectors starting at SECTOR were freed.  They
+   leave the running transaction, and if the log holds copies of
+   any of them, the transaction revokes them. */
+void journal_revoke(block_sector_t sector, size_t cnt) {
+  if (!journal_on)
+    return;
+
+  cache_journal_forget(sector, cnt);
+  lock_acquire(&journal_lock);
+  add_revoke(sector, cnt);
+  lock_release(&journal_lock);
+}
+
+/* Writes the transaction in STAGING, BLOCK_CNT sectors that free
+   RUN_CNT runs, to the log, which must have room for it, and lets
+   its sectors go home. */
+static void log_write(size_t block_cnt, size_t run_cnt) {
+  struct journal_desc *d = (struct journal_desc *)staging;
+  size_t len = block_cnt + 2;
+  struct journal_commit *c =
+      (struct journal_commit *)(staging + (len - 1) * BLOCK_SECTOR_SIZE);
+
+  ASSERT(log_used + len <= JOURNAL_LOG_SECTORS);
+
+  d->magic = DESC_MAGIC;
+  d->seq = next_seq;
+  d->block_cnt = block_cnt;
+  d->revoke_cnt = run_cnt;
+  memset(c, 0, sizeof *c);
+  c->magic = COMMIT_MAGIC;
+  c->seq = next_seq;
+  c->checksum = hash_bytes(staging, (len - 1) * BLOCK_SECTOR_SIZE);
+  block_write_multiple(fs_device, LOG_START + log_used, len, staging);
+
+  next_seq++;
+  log_used += len;
+  cache_journal_commit();
+}
+
+/* Commits the running transaction, if it changed anything: waits
+   for the open handles to end, copies the sectors they and
+   everybody else changed since the last commit into the log, and
+   checkpoints if the log is more than half full.  A transaction
+   too big for the log goes straight home instead, where a crash
+   in the middle would leave it half done, but only once a
+   checkpoint has emptied the log, so that replay cannot put older
+   copies back over it. */
+void journal_commit(void) {
+  struct journal_desc *d = (struct journal_desc *)staging;
+  block_sector_t stolen[CACHE_STOLEN_MAX];
+  size_t block_cnt, run_cnt, stolen_cnt;
+  bool fits;
+
+  if (!journal_on)
+    return;
+
+  lock_acquire(&journal_lock);
+  while (committing)
+    cond_wait(&journal_cond, &journal_lock);
+  if (cache_journal_pending() == 0 && revoke_cnt == 0 && !revoke_overflow) {
+    lock_release(&journal_lock);
+    return;
+  }
+  committing = true;
+  while (handle_cnt > 0)
+    cond_wait(&journal_cond, &journal_lock);
+
+  block_cnt = cache_journal_collect(d->entries, staging + BLOCK_SECTOR_SIZE,
+                                    TXN_SECTORS);
+
+  // The cache had to write some sectors home before this commit.
+  // Older copies in the log must not overwrite them on replay.
+  stolen_cnt = cache_journal_stolen(stolen);
+  if (stolen_cnt == SIZE_MAX)
+    revoke_overflow = true;
+  else
+    for (size_t i = 0; i < stolen_cnt; i++)
+      add_revoke(stolen[i], 1);
+
+  run_cnt = revoke_cnt;
+  fits = !revoke_overflow && block_cnt <= TXN_SECTORS &&
+         block_cnt + 2 * run_cnt <= DESC_ENTRIES;
+  if (fits)
+    for (size_t r = 0; r < run_cnt; r++) {
+      d->entries[block_cnt + 2 * r] = revokes[r].start;
+      d->entries[block_cnt + 2 * r + 1] = revokes[r].cnt;
+    }
+  revoke_cnt = 0;
+  revoke_overflow = false;
+  lock_release(&journal_lock);
+
+  if (!fits || log_used + block_cnt + 2 > JOURNAL_LOG_SECTORS)
+    checkpoint();
+  if (fits) {
+    lock_acquire(&journal_lock);
+    for (size_t i = 0; i < block_cnt; i++)
+      bitmap_mark(logged, d->entries[i]);
+    lock_release(&journal_lock);
+    log_write(block_cnt, run_cnt);
+    if (log_used > JOURNAL_LOG_SECTORS / 2)
+      checkpoint();
+  } else {
+    cache_journal_commit();
+    cache_flush();
+  }
+
+  lock_acquire(&journal_lock);
+  committing = false;
+  cond_broadcast(&journal_cond, &journal_lock);
+  lock_release(&journal_lock);
+}
+
+/* Writes every committed change home and empties the log.  Cache
+   entries with changes not committed yet must stay held back, so
+   for the logged sectors they hold, the newest copy in the log goes
+   home instead.  Nothing is left for replay to put back over later
+   home writes. */
+static void checkpoint(void) {
+  static struct journal_desc d;
+  static uint8_t block[BLOCK_SECTOR_SIZE];
+
+  cache_flush();
+  for (size_t pos = 0; pos < log_used; pos += d.block_cnt + 2) {
+    block_read(fs_device, LOG_START + pos, &d);
+    for (size_t i = 0; i < d.block_cnt; i++) {
+      block_sector_t sector = d.entries[i];
+      bool in_log;
+
+      lock_acquire(&journal_lock);
+      in_log = bitmap_test(logged, sector);
+      lock_release(&journal_lock);
+      if (in_log && cache_journal_held(sector)) {
+        block_read(fs_device, LOG_START + pos + 1 + i, block);
+        block_write(fs_device, sector, block);
+      }
+    }
+  }
+
+  write_header(next_seq);
+  log_used = 0;
+  lock_acquire(&journal_lock);
+  bitmap_set_all(logged, false);
+  lock_release(&journal_lock);
+}
+
+/* Reads the transaction at log sector POS into STAGING, if the
+   log holds all of transaction SEQ there, and returns its length
+   in sectors.  Returns 0 otherwise. */
+static size_t log_read(size_t pos, uint32_t seq) {
+  struct journal_desc *d = (struct journal_desc *)staging;
+  struct journal_commit *c;
+  size_t len;
+
+  if (pos + 2 > JOURNAL_LOG_SECTORS)
+    return 0;
+  block_read(fs_device, LOG_START + pos, d);
+  if (d->magic != DESC_MAGIC || d->seq != seq ||
+      d->block_cnt > TXN_SECTORS || d->revoke_cnt > REVOKE_MAX ||
+      d->block_cnt + 2 * d->revoke_cnt > DESC_ENTRIES ||
+      pos + d->block_cnt + 2 > JOURNAL_LOG_SECTORS)
+    return 0;
+
+  len = d->block_cnt + 2;
+  block_read_multiple(fs_device, LOG_START + pos + 1, len - 1,
+                      staging + BLOCK_SECTOR_SIZE);
+  c = (struct journal_commit *)(staging + (len - 1) * BLOCK_SECTOR_SIZE);
+  if (c->magic != COMMIT_MAGIC || c->seq != seq ||
+      c->checksum != hash_bytes(staging, (len - 1) * BLOCK_SECTOR_SIZE))
+    return 0;
+  return len;
+}
+
+/* Returns whether one of the transactions after transaction T of
+   the CNT in DESCS frees SECTOR. */
+static bool revoked(const struct journal_desc *descs, size_t cnt, size_t t,
+                    block_sector_t sector) {
+  for (size_t u = t + 1; u < cnt; u++) {
+    const block_sector_t *runs = descs[u].entries + descs[u].block_cnt;
+    for (size_t r = 0; r < descs[u].revoke_cnt; r++)
+      if (sector - runs[2 * r] < runs[2 * r + 1])
+        return true;
+  }
+  return false;
+}
+
+/* Copies the sectors of the complete transactions in the log,
+   the first of which is SEQ, home.  Returns the number of the
+   transaction after them. */
+static uint32_t replay(uint32_t seq) {
+  size_t max = JOURNAL_LOG_SECTORS / 2;
+  struct journal_desc *descs = malloc(max * sizeof *descs);
+  size_t cnt = 0, pos = 0, len;
+
+  if (descs == NULL)
+    PANIC("can't allocate journal");
+
+  // Find the transactions, then copy each one home, oldest first.
+  while (cnt < max && (len = log_read(pos, seq + cnt)) > 0) {
+    memcpy(&descs[cnt++], staging, sizeof *descs);
+    pos += len;
+  }
+  pos = 0;
+  for (size_t t = 0; t < cnt; t++) {
+    size_t block_cnt = descs[t].block_cnt;
+    if (block_cnt > 0)
+      block_read_multiple(fs_device, LOG_START + pos + 1, block_cnt, staging);
+    for (size_t i = 0; i < block_cnt; i++)
+      if (!revoked(descs, cnt, t, descs[t].entries[i]))
+        block_write(fs_device, descs[t].entries[i],
+                    staging + i * BLOCK_SECTOR_SIZE);
+    pos += block_cnt + 2;
+  }
+  free(descs);
+
+  if (cnt > 0)
+    printf("filesys: replayed %zu journal transactions\n", cnt);
+  return seq + cnt;
+}
+
+/* Journal daemon: commits the running transaction every
+   JOURNAL_COMMIT_MS. */
+static void journal_daemon(void *aux UNUSED) {
+  while (true) {
+    timer_msleep(JOURNAL_COMMIT_MS);
+    journal_commit();
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include "devices/block.h"
+#include <stddef.h>
+
+/* The journal takes the JOURNAL_SECTORS sectors starting at
+   JOURNAL_SECTOR: a header followed by the log.  Disks of fewer
+   than JOURNAL_MIN_DISK sectors go without. */
+#define JOURNAL_LOG_SECTORS 128
+#define JOURNAL_SECTORS (1 + JOURNAL_LOG_SECTORS)
+#define JOURNAL_MIN_DISK (8 * JOURNAL_SECTORS)
+
+void journal_create(void);
+void journal_init(void);
+void journal_done(void);
+
+void journal_begin(void);
+void journal_end(void);
+void journal_commit(void);
+void journal_revoke(block_sector_t, size_t);
+
+#endif /* filesys/journal.h */
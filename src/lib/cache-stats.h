@@ -0,0 +1,24 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache statistics, as returned by the cache_stats()
+   system call. */
+struct cache_stats
+  {
+    unsigned long long size;              /* Sectors in the cache. */
+    unsigned long long hits;              /* Lookups found cached. */
+    unsigned long long misses;            /* Lookups that took an entry. */
+    unsigned long long evictions;         /* Valid entries recycled. */
+    unsigned long long writebacks;        /* Dirty sectors written on
+                                             eviction or close. */
+    unsigned long long read_ahead_issued; /* Sectors read ahead. */
+    unsigned long long read_ahead_used;   /* ...and later looked up. */
+    unsigned long long flush_rounds;      /* Write-behind rounds. */
+    unsigned long long flush_sectors;     /* Sectors written behind. */
+    unsigned long long flush_requests;    /* Write-behind disk requests. */
+    unsigned long long lock_waits;        /* Contended cache_lock
+                                             acquisitions. */
+    unsigned long long lock_wait_ticks;   /* Timer ticks spent in them. */
+  };
+
+#endif /* lib/cache-stats.h */
@@ -0,0 +1,18 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+#include <stdbool.h>
+
+/* Longest file name in a directory entry, the same as the kernel's
+   NAME_MAX and READDIR_MAX_LEN. */
+#define DIRENT_NAME_MAX 14
+
+/* A directory entry, as returned by the getdents() system call. */
+struct dirent
+  {
+    int inumber;                        /* Inode number of the file. */
+    bool is_dir;                        /* True for a directory. */
+    char name[DIRENT_NAME_MAX + 1];     /* Null terminated file name. */
+  };
+
+#endif /* lib/dirent.h */
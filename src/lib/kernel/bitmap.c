@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include "threads/malloc.h"
 #ifdef FILESYS
+#include <string.h>
 #include "filesys/file.h"
 #endif
 
@@ -21,13 +22,25 @@ typedef unsigned long elem_type;
 /* Number of bits in an element. */
 #define ELEM_BITS (sizeof (elem_type) * CHAR_BIT)
 
+/* Number of bits in a summary chunk.  Must be a multiple of
+   ELEM_BITS. */
+#define CHUNK_BITS 1024
+
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits.
+
+   A bitmap made by bitmap_create() with more than CHUNK_BITS
+   bits also keeps a summary: the number of true bits in each
+   CHUNK_BITS-bit chunk, which lets scans skip chunks that are
+   all true or all false.  The summary is updated alongside the
+   bits but not atomically with them, so changes to a bitmap
+   with a summary must be serialized by the caller. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    uint16_t *summary;  /* True bits per chunk, or a null pointer. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -68,6 +81,69 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns the number of bits set in E. */
+static inline size_t
+elem_popcount (elem_type e)
+{
+  size_t cnt = 0;
+  for (; e != 0; e &= e - 1)
+    cnt++;
+  return cnt;
+}
+
+/* Returns the number of summary chunks for BIT_CNT bits. */
+static inline size_t
+chunk_cnt (size_t bit_cnt)
+{
+  return DIV_ROUND_UP (bit_cnt, CHUNK_BITS);
+}
+
+/* Returns true if the chunk of B that contains bit BIT_IDX is
+   known to hold only bits set to VALUE. */
+static inline bool
+chunk_is_all (const struct bitmap *b, size_t bit_idx, bool value)
+{
+  size_t chunk = bit_idx / CHUNK_BITS;
+  size_t size = b->bit_cnt - chunk * CHUNK_BITS;
+  if (b->summary == NULL)
+    return false;
+  if (size > CHUNK_BITS)
+    size = CHUNK_BITS;
+  return b->summary[chunk] == (value ? size : 0);
+}
+
+/* Returns the index of the first bit in B at or after START
+   that is set to VALUE, or the size of B if there is none.
+   Looks at a whole element at a time and skips summary chunks
+   that hold only !VALUE bits. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, bool value)
+{
+  size_t bit_idx = start;
+
+  while (bit_idx < b->bit_cnt)
+    {
+      size_t idx = elem_idx (bit_idx);
+      elem_type e;
+
+      if (chunk_is_all (b, bit_idx, !value))
+        {
+          bit_idx = (bit_idx / CHUNK_BITS + 1) * CHUNK_BITS;
+          continue;
+        }
+
+      e = value ? b->bits[idx] : ~b->bits[idx];
+      e &= (elem_type) -1 << (bit_idx % ELEM_BITS);
+      if (e != 0)
+        {
+          bit_idx = idx * ELEM_BITS + __builtin_ctzl (e);
+          break;
+        }
+      bit_idx = (idx + 1) * ELEM_BITS;
+    }
+  return bit_idx < b->bit_cnt ? bit_idx : b->bit_cnt;
+}
 
 /* Creation and destruction. */
 
@@ -83,10 +159,18 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
+      b->summary = NULL;
       if (b->bits != NULL || bit_cnt == 0)
         {
           bitmap_set_all (b, false);
-          return b;
+          if (bit_cnt <= CHUNK_BITS)
+            return b;
+
+          /* All bits are false, so all counts are 0. */
+          b->summary = calloc (chunk_cnt (bit_cnt), sizeof *b->summary);
+          if (b->summary != NULL)
+            return b;
+          free (b->bits);
         }
       free (b);
     }
@@ -105,6 +189,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->summary = NULL;
   bitmap_set_all (b, false);
   return b;
 }
@@ -124,6 +209,7 @@ bitmap_destroy (struct bitmap *b)
 {
   if (b != NULL) 
     {
+      free (b->summary);
       free (b->bits);
       free (b);
     }
@@ -159,6 +245,9 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
 
+  if (b->summary != NULL && !(b->bits[idx] & mask))
+    b->summary[bit_idx / CHUNK_BITS]++;
+
   /* This is equivalent to `b->bits[idx] |= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
@@ -172,6 +261,9 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
 
+  if (b->summary != NULL && (b->bits[idx] & mask))
+    b->summary[bit_idx / CHUNK_BITS]--;
+
   /* This is equivalent to `b->bits[idx] &= ~mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
@@ -187,6 +279,14 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
   size_t idx = elem_idx (bit_idx);
   elem_type mask = bit_mask (bit_idx);
 
+  if (b->summary != NULL)
+    {
+      if (b->bits[idx] & mask)
+        b->summary[bit_idx / CHUNK_BITS]--;
+      else
+        b->summary[bit_idx / CHUNK_BITS]++;
+    }
+
   /* This is equivalent to `b->bits[idx] ^= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
@@ -213,18 +313,41 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, a whole element at a
+   time. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
+  size_t end = start + cnt;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      size_t ofs = start % ELEM_BITS;
+      size_t n = end - start < ELEM_BITS - ofs ? end - start : ELEM_BITS - ofs;
+      elem_type mask = ((elem_type) -1 >> (ELEM_BITS - n)) << ofs;
+
+      if (b->summary != NULL)
+        {
+          uint16_t *chunk = &b->summary[start / CHUNK_BITS];
+          if (value)
+            *chunk += elem_popcount (~b->bits[idx] & mask);
+          else
+            *chunk -= elem_popcount (b->bits[idx] & mask);
+        }
+
+      /* Same as in bitmap_mark() and bitmap_reset(). */
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+      start += n;
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -250,16 +373,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return cnt > 0 && next_bit (b, start, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -291,22 +409,29 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   Jumps from one run of VALUE bits to the next, finding the ends
+   of runs a whole element at a time, so the cost depends on the
+   number of runs rather than the number of bits. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt == 0)
+    return start;
+  for (;;)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t first = next_bit (b, start, value);
+      size_t end;
+      if (b->bit_cnt - first < cnt)
+        return BITMAP_ERROR;
+      end = next_bit (b, first, !value);
+      if (end - first >= cnt)
+        return first;
+      start = end;
     }
-  return BITMAP_ERROR;
 }
 
 /* Finds the first group of CNT consecutive bits in B at or after
@@ -335,6 +460,19 @@ bitmap_file_size (const struct bitmap *b)
   return byte_cnt (b->bit_cnt);
 }
 
+/* Recounts the summary of B from its bits. */
+static void
+summary_rebuild (struct bitmap *b)
+{
+  size_t i;
+
+  if (b->summary == NULL)
+    return;
+  memset (b->summary, 0, chunk_cnt (b->bit_cnt) * sizeof *b->summary);
+  for (i = 0; i < elem_cnt (b->bit_cnt); i++)
+    b->summary[i * ELEM_BITS / CHUNK_BITS] += elem_popcount (b->bits[i]);
+}
+
 /* Reads B from FILE.  Returns true if successful, false
    otherwise. */
 bool
@@ -346,6 +484,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      summary_rebuild (b);
     }
   return success;
 }
@@ -358,6 +497,27 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds the CNT bits starting at
+   START to the same place in FILE, which must already hold the
+   rest of B.  Returns true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  off_t ofs, size;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (cnt <= b->bit_cnt - start);
+
+  if (cnt == 0)
+    return true;
+  ofs = start / CHAR_BIT;
+  size = DIV_ROUND_UP (start + cnt, CHAR_BIT) - ofs;
+  return file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+         == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -28,7 +28,17 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_CACHE_STATS,            /* Reads buffer cache statistics. */
+    SYS_FILEBLOCKS,             /* Reports sectors allocated to a file. */
+    SYS_FALLOCATE,              /* Preallocates file space. */
+    SYS_GETDENTS,               /* Reads several directory entries. */
+    SYS_PREAD,                  /* Reads from a file at an offset. */
+    SYS_PWRITE,                 /* Writes to a file at an offset. */
+    SYS_READV,                  /* Reads into several buffers. */
+    SYS_WRITEV                  /* Writes from several buffers. */
   };
 
 #endif /* lib/syscall-nr.h */
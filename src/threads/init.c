@@ -36,6 +36,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -247,6 +248,17 @@ static char **parse_options(char **argv) {
       filesys_bdev_name = value;
     else if (!strcmp(name, "-scratch"))
       scratch_bdev_name = value;
+    else if (!strcmp(name, "-bc"))
+      cache_set_size(atoi(value));
+    else if (!strcmp(name, "-cp")) {
+      if (!strcmp(value, "clock"))
+        cache_set_policy(CACHE_CLOCK);
+      else if (!strcmp(value, "2q"))
+        cache_set_policy(CACHE_2Q);
+      else
+        PANIC("unknown cache policy `%s' (use -h for help)", value);
+    } else if (!strcmp(name, "-wb"))
+      cache_set_flush_age(atoi(value));
 #ifdef VM
     else if (!strcmp(name, "-swap"))
       swap_bdev_name = value;
@@ -363,6 +375,9 @@ static void usage(void) {
          "  -f                 Format file system device during startup.\n"
          "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
          "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+         "  -bc=SECTORS        Cache SECTORS file system sectors.\n"
+         "  -cp=POLICY         Cache replacement POLICY, clock or 2q (default).\n"
+         "  -wb=MSEC           Write back dirty cache blocks after MSEC ms.\n"
 #ifdef VM
          "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -31,6 +31,7 @@ struct pool
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
     uint8_t *base;                      /* Base of pool. */
+    size_t next_fit;                    /* Where the next search starts. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -77,8 +78,15 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   if (page_cnt == 0)
     return NULL;
 
+  /* Search next-fit: from where the last allocation ended,
+     wrapping around to the start of the pool. */
   lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  page_idx = bitmap_scan_and_flip (pool->used_map, pool->next_fit,
+                                   page_cnt, false);
+  if (page_idx == BITMAP_ERROR && pool->next_fit > 0)
+    page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (page_idx != BITMAP_ERROR)
+    pool->next_fit = page_idx + page_cnt;
   lock_release (&pool->lock);
 
   if (page_idx != BITMAP_ERROR)
@@ -167,6 +175,7 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->next_fit = 0;
 }
 
 /* Returns true if PAGE was allocated from POOL,
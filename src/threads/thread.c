@@ -47,9 +47,6 @@ static struct thread *initial_thread;
 /* Lock used by allocate_tid(). */
 static struct lock tid_lock;
 
-/* Lock used by file operations. */
-static struct lock file_lock;
-
 /* Stack frame for kernel_thread(). */
 struct kernel_thread_frame {
   void *eip;             /* Return address. */
@@ -102,7 +99,6 @@ void thread_init(void) {
   lock_init(&tid_lock);
   list_init(&ready_list);
   list_init(&all_list);
-  lock_init(&file_lock); // Initialize the file lock
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread();
   init_thread(initial_thread, "main", PRI_DEFAULT);
@@ -458,6 +454,8 @@ static void init_thread(struct thread *t, const char *name, int priority) {
 
 #ifdef FILESYS
   t->cwd = NULL; // Set the current working directory to root
+  t->journal_depth = 0;
+  t->batch_depth = 0;
 #endif
 
   old_level = intr_disable();
@@ -564,9 +562,6 @@ static tid_t allocate_tid(void) {
   return tid;
 }
 
-void acquire_file_lock(void) { lock_acquire(&file_lock); }
-void release_file_lock(void) { lock_release(&file_lock); }
-
 /* Offset of `stack' member within `struct thread'.
    Used by switch.S, which can't figure it out on its own. */
 uint32_t thread_stack_ofs = offsetof(struct thread, stack);
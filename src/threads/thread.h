@@ -131,7 +131,9 @@ struct thread {
 #endif
 
 #ifdef FILESYS
-  struct dir *cwd; /* Current working directory */
+  struct dir *cwd;   /* Current working directory */
+  int journal_depth; /* Nesting of open journal handles */
+  int batch_depth;   /* Nesting of open free map batches */
 #endif
 
   /* Owned by thread.c. */
@@ -199,7 +201,4 @@ void thread_set_nice(int);
 int thread_get_recent_cpu(void);
 int thread_get_load_avg(void);
 
-// The lock for file operations
-void acquire_file_lock(void);
-void release_file_lock(void);
 #endif /* threads/thread.h */
@@ -90,13 +90,7 @@ static void start_process(void *file_name_) {
   char *save_ptr;
   char *name = strtok_r(file_name, " ", &save_ptr);
 
-#ifdef VM
-  acquire_file_lock();
-  success = load(name, &if_.eip, &if_.esp);
-  release_file_lock();
-#else
   success = load(name, &if_.eip, &if_.esp);
-#endif
 
   if (success) {
     int argc = 0;
@@ -208,9 +202,7 @@ void process_exit(void) {
     struct thread_file *thread_file =
         list_entry(file, struct thread_file, elem);
 
-    acquire_file_lock();
     file_close(thread_file->file);
-    release_file_lock();
 
     list_remove(file);
     free(thread_file);
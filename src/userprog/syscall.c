@@ -4,6 +4,7 @@
 #include "userprog/syscall.h"
 #include "devices/input.h"
 #include "devices/shutdown.h"
+#include "filesys/cache.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
@@ -16,11 +17,13 @@
 #include "threads/vaddr.h"
 #include "userprog/pagedir.h"
 #include "userprog/process.h"
+#include <iovec.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syscall-nr.h>
 
 #ifdef VM
@@ -54,6 +57,14 @@ static bool mkdir(const char *);
 static bool readdir(int, char *);
 static bool isdir(int);
 static int inumber(int);
+static bool cache_stats(struct cache_stats *);
+static int fileblocks(int);
+static bool fallocate(int, unsigned, unsigned);
+static int getdents(int, struct dirent *, unsigned);
+static int pread(int, void *, unsigned, unsigned);
+static int pwrite(int, const void *, unsigned, unsigned);
+static int readv(int, const struct iovec *, int);
+static int writev(int, const struct iovec *, int);
 
 /* Find the file based on fd */
 static struct thread_file *find_file(int fd) {
@@ -131,6 +142,20 @@ static void *check_write(void *vaddr, size_t size) {
   return vaddr;
 }
 
+/* Check if buffer is able to read */
+static const void *check_read(const void *vaddr, size_t size) {
+  if (!is_user_vaddr(vaddr) ||
+      (size > 0 && !is_user_vaddr(vaddr + size - 1)))
+    exit(-1);
+
+  // Check each byte is able to read
+  for (size_t i = 0; i < size; i++) {
+    if (get_user(vaddr + i) == -1)
+      exit(-1);
+  }
+  return vaddr;
+}
+
 /* Helper function to get a user byte from the address space. */
 static int get_user(const uint8_t *uaddr) {
   int result;
@@ -288,6 +313,73 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
     break;
   }
 
+  case SYS_CACHE_STATS: {
+    struct cache_stats *stats =
+        *(struct cache_stats **)check_address(f->esp + sizeof(int *));
+    f->eax = cache_stats(stats);
+    break;
+  }
+
+  case SYS_FILEBLOCKS: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    f->eax = (uint32_t)fileblocks(fd);
+    break;
+  }
+
+  case SYS_FALLOCATE: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    unsigned offset = *(unsigned *)check_address(f->esp + 2 * sizeof(int *));
+    unsigned length = *(unsigned *)check_address(f->esp + 3 * sizeof(int *));
+    f->eax = fallocate(fd, offset, length);
+    break;
+  }
+
+  case SYS_GETDENTS: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    struct dirent *entries =
+        *(struct dirent **)check_address(f->esp + 2 * sizeof(int *));
+    unsigned cnt = *(unsigned *)check_address(f->esp + 3 * sizeof(int *));
+    f->eax = getdents(fd, entries, cnt);
+    break;
+  }
+
+  case SYS_PREAD: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    void *buffer = *(void **)check_address(f->esp + 2 * sizeof(int *));
+    unsigned size = *(unsigned *)check_address(f->esp + 3 * sizeof(int *));
+    unsigned offset = *(unsigned *)check_address(f->esp + 4 * sizeof(int *));
+    f->eax = (uint32_t)pread(fd, buffer, size, offset);
+    break;
+  }
+
+  case SYS_PWRITE: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    const void *buffer =
+        *(const void **)check_address(f->esp + 2 * sizeof(int *));
+    unsigned size = *(unsigned *)check_address(f->esp + 3 * sizeof(int *));
+    unsigned offset = *(unsigned *)check_address(f->esp + 4 * sizeof(int *));
+    f->eax = (uint32_t)pwrite(fd, buffer, size, offset);
+    break;
+  }
+
+  case SYS_READV: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    const struct iovec *iov =
+        *(const struct iovec **)check_address(f->esp + 2 * sizeof(int *));
+    int iovcnt = *(int *)check_address(f->esp + 3 * sizeof(int *));
+    f->eax = (uint32_t)readv(fd, iov, iovcnt);
+    break;
+  }
+
+  case SYS_WRITEV: {
+    int fd = *(int *)check_address(f->esp + sizeof(int *));
+    const struct iovec *iov =
+        *(const struct iovec **)check_address(f->esp + 2 * sizeof(int *));
+    int iovcnt = *(int *)check_address(f->esp + 3 * sizeof(int *));
+    f->eax = (uint32_t)writev(fd, iov, iovcnt);
+    break;
+  }
+
   default:
     PANIC("Unknown system call.");
   }
@@ -337,9 +429,7 @@ static int write(int fd, const void *buffer, unsigned size) {
     if (isdir(fd))
       return -1;
 
-    acquire_file_lock();
     int bytes_written = file_write(thread_file->file, buffer, size);
-    release_file_lock();
 
     return bytes_written;
   }
@@ -416,9 +506,7 @@ static bool create(const char *file, unsigned initial_size) {
   if (!check_str(file, 14))
     return false;
 
-  acquire_file_lock();
   bool success = filesys_create(file, initial_size, false);
-  release_file_lock();
   return success;
 }
 
@@ -429,9 +517,7 @@ static bool remove(const char *file) {
   if (!check_str(file, 14))
     return false;
 
-  acquire_file_lock();
   bool success = filesys_remove(file);
-  release_file_lock();
   return success;
 }
 
@@ -457,17 +543,13 @@ static int open(const char *file) {
   if (!check_str(file, 129))
     return -1;
 
-  acquire_file_lock();
   struct file *file_open = filesys_open(file);
-  if (file_open == NULL) {
-    release_file_lock();
+  if (file_open == NULL)
     return -1;
-  }
 
   struct thread_file *thread_file = malloc(sizeof(struct thread_file));
   if (thread_file == NULL) {
     file_close(file_open);
-    release_file_lock();
     return -1;
   }
 
@@ -483,7 +565,6 @@ static int open(const char *file) {
 
   list_push_back(&cur->files, &thread_file->elem);
 
-  release_file_lock();
   return thread_file->fd;
 }
 
@@ -495,9 +576,7 @@ static int filesize(int fd) {
   if (isdir(fd))
     return -1;
 
-  acquire_file_lock();
   int size = file_length(thread_file->file);
-  release_file_lock();
 
   return size;
 }
@@ -524,9 +603,7 @@ static int read(int fd, void *buffer, unsigned size) {
     if (isdir(fd))
       return -1;
 
-    acquire_file_lock();
     int bytes_read = file_read(thread_file->file, buffer, size);
-    release_file_lock();
 
     return bytes_read;
   }
@@ -550,9 +627,7 @@ static void seek(int fd, unsigned position) {
   if (isdir(fd))
     return;
 
-  acquire_file_lock();
   file_seek(thread_file->file, position);
-  release_file_lock();
 }
 
 /* Returns the position of the next byte to be read or written in open
@@ -564,9 +639,7 @@ static unsigned tell(int fd) {
   if (isdir(fd))
     return -1;
 
-  acquire_file_lock();
   unsigned position = file_tell(thread_file->file);
-  release_file_lock();
 
   return position;
 }
@@ -579,7 +652,6 @@ static void close(int fd) {
   if (thread_file == NULL)
     return;
 
-  acquire_file_lock();
   file_close(thread_file->file);
   if (thread_file->dir) {
     free(thread_file->dir);
@@ -587,7 +659,6 @@ static void close(int fd) {
   }
   list_remove(&thread_file->elem);
   free(thread_file);
-  release_file_lock();
 }
 
 #ifdef VM
@@ -644,27 +715,19 @@ static mapid_t mmap(int fd, void *addr) {
   struct file *file = NULL;
   bool spte_fail_midway = false;
 
-  acquire_file_lock();
-
   /* Reopen file */
   file = file_reopen(file_desc->file);
-  if (file == NULL) {
-    release_file_lock();
+  if (file == NULL)
     return -1;
-  }
 
   /* Validate file size. */
   off_t file_size = file_length(file);
-  if (file_size <= 0) {
-    release_file_lock();
+  if (file_size <= 0)
     return -1;
-  }
 
   /* Check if the address range is valid. */
-  if (!check_overlaps(addr, file_size)) {
-    release_file_lock();
+  if (!check_overlaps(addr, file_size))
     return -1;
-  }
 
   uint32_t real_bytes = file_size;
   uint32_t zero_bytes = (PGSIZE - real_bytes % PGSIZE) % PGSIZE;
@@ -676,7 +739,6 @@ static mapid_t mmap(int fd, void *addr) {
 
   if (mmap_entry == NULL) {
     file_close(file);
-    release_file_lock();
     return -1;
   }
 
@@ -703,7 +765,6 @@ static mapid_t mmap(int fd, void *addr) {
     list_push_back(&thread_current()->mmap_list, &mmap_entry->elem);
     mapping = mmap_entry->mapid;
   }
-  release_file_lock();
   return mapping;
 }
 
@@ -748,12 +809,9 @@ void munmap(mapid_t mapping_to_unmap) {
     struct sup_page_table_entry *spte = find_spte(current_page_addr);
 
     if (spte) {
-      if (pagedir_is_dirty(cur_thread->pagedir, spte->uaddr)) {
-        acquire_file_lock();
-        file_seek(spte->file, spte->offset);
-        file_write(spte->file, current_page_addr, spte->read_bytes);
-        release_file_lock();
-      }
+      if (pagedir_is_dirty(cur_thread->pagedir, spte->uaddr))
+        file_write_at(spte->file, current_page_addr, spte->read_bytes,
+                      spte->offset);
 
       if (pagedir_get_page(cur_thread->pagedir, spte->uaddr)) {
         frame_free(pagedir_get_page(cur_thread->pagedir, spte->uaddr));
@@ -766,9 +824,7 @@ void munmap(mapid_t mapping_to_unmap) {
     current_page_addr = (void *)((char *)current_page_addr + PGSIZE);
   }
 
-  acquire_file_lock();
   file_close(file_to_process);
-  release_file_lock();
 
   free(found_mmap_entry);
 
@@ -783,9 +839,7 @@ static bool chdir(const char *dir) {
   if (!check_str(dir, NAME_MAX + 1))
     return false;
 
-  acquire_file_lock();
   bool success = filesys_chdir(dir);
-  release_file_lock();
   return success;
 }
 
@@ -797,9 +851,7 @@ static bool mkdir(const char *dir) {
   if (!check_str(dir, NAME_MAX + 1))
     return false;
 
-  acquire_file_lock();
   bool success = filesys_create(dir, 0, true);
-  release_file_lock();
   return success;
 }
 
@@ -814,10 +866,8 @@ static bool readdir(int fd, char *name) {
   struct thread_file *thread_file = find_file(fd);
   bool success = false;
 
-  acquire_file_lock();
   if (thread_file != NULL && thread_file->dir != NULL)
     success = dir_readdir(thread_file->dir, name);
-  release_file_lock();
 
   return success;
 }
@@ -828,11 +878,9 @@ static bool isdir(int fd) {
   struct thread_file *thread_file = find_file(fd);
   bool result = false;
 
-  acquire_file_lock();
   struct inode *inode = file_get_inode(thread_file->file);
   if (inode != NULL)
     result = inode_is_directory(inode);
-  release_file_lock();
 
   return result;
 }
@@ -844,11 +892,252 @@ static int inumber(int fd) {
   struct thread_file *thread_file = find_file(fd);
   int inode_number = -1;
 
-  acquire_file_lock();
   struct inode *inode = file_get_inode(thread_file->file);
   if (inode != NULL)
     inode_number = inode_get_inumber(inode);
-  release_file_lock();
 
   return inode_number;
 }
+
+/* Copies the buffer cache statistics to STATS. */
+static bool cache_stats(struct cache_stats *stats) {
+  struct cache_stats copy;
+
+  check_write(stats, sizeof *stats);
+  cache_get_stats(&copy);
+  memcpy(stats, &copy, sizeof copy);
+  return true;
+}
+
+/* Returns the number of disk sectors that hold the data of the
+   file open as FD, which is less than its size in sectors if it
+   has holes. */
+static int fileblocks(int fd) {
+  struct thread_file *thread_file = find_file(fd);
+  if (thread_file == NULL)
+    return -1;
+  if (isdir(fd))
+    return -1;
+
+  return file_allocated_sectors(thread_file->file);
+}
+
+/* Allocates disk space for the LENGTH bytes of the file open as
+   FD starting at OFFSET, extending the file if they go past its
+   end, so that writing them later lands on sectors in file order.
+   The space reads as zeros. */
+static bool fallocate(int fd, unsigned offset, unsigned length) {
+  struct thread_file *thread_file = find_file(fd);
+  if (thread_file == NULL)
+    return false;
+  if (isdir(fd))
+    return false;
+
+  return file_allocate(thread_file->file, offset, length);
+}
+
+/* Entries that getdents() reads from the directory at a time. */
+#define GETDENTS_BATCH 16
+
+/* Reads up to CNT more entries of the directory open as FD into
+   ENTRIES, with the inode number of each and whether it is a
+   directory, so that listing a directory takes a few calls
+   instead of one per entry and no opens.  Returns the number of
+   entries read, 0 at the end of the directory, or -1 if FD is not
+   an open directory. */
+static int getdents(int fd, struct dirent *entries, unsigned cnt) {
+  struct thread_file *thread_file = find_file(fd);
+  struct dirent batch[GETDENTS_BATCH];
+  unsigned n = 0;
+
+  if (thread_file == NULL || thread_file->dir == NULL)
+    return -1;
+
+  // Copied out a batch at a time, with no locks held
+  while (n < cnt) {
+    size_t want = cnt - n < GETDENTS_BATCH ? cnt - n : GETDENTS_BATCH;
+    size_t got = dir_readdir_many(thread_file->dir, batch, want);
+
+    check_write(entries + n, got * sizeof *batch);
+    memcpy(entries + n, batch, got * sizeof *batch);
+    n += got;
+    if (got < want)
+      break;
+  }
+  return n;
+}
+
+/* Returns the file open as FD for pread() and the like, or NULL if
+   FD is not an open file or is a directory. */
+static struct file *find_regular_file(int fd) {
+  struct thread_file *thread_file = find_file(fd);
+  if (thread_file == NULL || isdir(fd))
+    return NULL;
+  return thread_file->file;
+}
+
+/* Reads SIZE bytes from the file open as FD, starting at byte
+   OFFSET, into BUFFER.  Unlike seek() and read(), leaves the
+   file's position alone.  Returns the number of bytes actually
+   read, or -1 if FD is not an open file. */
+static int pread(int fd, void *buffer, unsigned size, unsigned offset) {
+  check_write(buffer, size);
+
+  struct file *file = find_regular_file(fd);
+  if (file == NULL || offset > INT32_MAX || size > INT32_MAX - offset)
+    return -1;
+
+  return file_read_at(file, buffer, size, offset);
+}
+
+/* Writes SIZE bytes from BUFFER to the file open as FD, starting at
+   byte OFFSET, extending the file if needed.  Unlike seek() and
+   write(), leaves the file's position alone.  Returns the number
+   of bytes actually written, or -1 if FD is not an open file. */
+static int pwrite(int fd, const void *buffer, unsigned size,
+                  unsigned offset) {
+  check_read(buffer, size);
+
+  struct file *file = find_regular_file(fd);
+  if (file == NULL || offset > INT32_MAX || size > INT32_MAX - offset)
+    return -1;
+
+  return file_write_at(file, buffer, size, offset);
+}
+
+/* Bytes that readv() and writev() move through the file at a time.
+   Up to this many take a single file read or write. */
+#define IOV_BUF_SIZE (4 * PGSIZE)
+
+/* Copies the IOVCNT buffers described at IOV into KIOV, checking
+   each of them, for writing if WRITABLE.  Returns their total
+   length, or -1 if IOVCNT is out of range or the total is too
+   big. */
+static int iov_copy_in(const struct iovec *iov, int iovcnt,
+                       struct iovec *kiov, bool writable) {
+  size_t total = 0;
+
+  if (iovcnt < 0 || iovcnt > IOV_MAX)
+    return -1;
+  if (iovcnt == 0)
+    return 0;
+  check_read(iov, iovcnt * sizeof *iov);
+  memcpy(kiov, iov, iovcnt * sizeof *iov);
+
+  for (int i = 0; i < iovcnt; i++) {
+    if (kiov[i].iov_len > (size_t)INT32_MAX - total)
+      return -1;
+    total += kiov[i].iov_len;
+    if (writable)
+      check_write(kiov[i].iov_base, kiov[i].iov_len);
+    else
+      check_read(kiov[i].iov_base, kiov[i].iov_len);
+  }
+  return total;
+}
+
+/* Copies SIZE bytes between BUF and the buffers in KIOV, starting
+   at byte *OFS of buffer *I and advancing both, into the buffers
+   if TO_IOV. */
+static void iov_copy(struct iovec *kiov, int *i, size_t *ofs, uint8_t *buf,
+                     size_t size, bool to_iov) {
+  while (size > 0) {
+    struct iovec *v = &kiov[*i];
+    size_t chunk = v->iov_len - *ofs < size ? v->iov_len - *ofs : size;
+    uint8_t *base = (uint8_t *)v->iov_base + *ofs;
+
+    if (to_iov)
+      memcpy(base, buf, chunk);
+    else
+      memcpy(buf, base, chunk);
+    buf += chunk;
+    size -= chunk;
+    *ofs += chunk;
+    if (*ofs == v->iov_len) {
+      ++*i;
+      *ofs = 0;
+    }
+  }
+}
+
+/* Reads from the file open as FD, or the keyboard for fd 0, into
+   the IOVCNT buffers at IOV in order, as read() would into one
+   buffer as long as all of them.  The buffers are checked once,
+   and up to IOV_BUF_SIZE bytes take one file read.  Returns the
+   number of bytes actually read, or -1 on error. */
+static int readv(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec kiov[IOV_MAX];
+  struct file *file = NULL;
+  uint8_t *buf;
+  int total, done = 0, i = 0;
+  size_t ofs = 0;
+
+  total = iov_copy_in(iov, iovcnt, kiov, true);
+  if (total < 0)
+    return -1;
+  if (fd != STDIN && (file = find_regular_file(fd)) == NULL)
+    return -1;
+  if (total == 0)
+    return 0;
+  buf = malloc(total < IOV_BUF_SIZE ? total : IOV_BUF_SIZE);
+  if (buf == NULL)
+    return -1;
+
+  while (done < total) {
+    int want = total - done < IOV_BUF_SIZE ? total - done : IOV_BUF_SIZE;
+    int got = want;
+
+    if (file == NULL)
+      for (int k = 0; k < want; k++)
+        buf[k] = input_getc();
+    else
+      got = file_read(file, buf, want);
+    iov_copy(kiov, &i, &ofs, buf, got, true);
+    done += got;
+    if (got < want)
+      break;
+  }
+  free(buf);
+  return done;
+}
+
+/* Writes the IOVCNT buffers at IOV in order to the file open as FD,
+   or the console for fd 1, as write() would one buffer as long as
+   all of them.  The buffers are checked once, and up to
+   IOV_BUF_SIZE bytes take one file write, so that other writers
+   cannot come in between.  Returns the number of bytes actually
+   written, or -1 on error. */
+static int writev(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec kiov[IOV_MAX];
+  struct file *file = NULL;
+  uint8_t *buf;
+  int total, done = 0, i = 0;
+  size_t ofs = 0;
+
+  total = iov_copy_in(iov, iovcnt, kiov, false);
+  if (total < 0)
+    return -1;
+  if (fd != STDOUT && (file = find_regular_file(fd)) == NULL)
+    return -1;
+  if (total == 0)
+    return 0;
+  buf = malloc(total < IOV_BUF_SIZE ? total : IOV_BUF_SIZE);
+  if (buf == NULL)
+    return -1;
+
+  while (done < total) {
+    int want = total - done < IOV_BUF_SIZE ? total - done : IOV_BUF_SIZE;
+    int put = want;
+
+    iov_copy(kiov, &i, &ofs, buf, want, false);
+    if (file == NULL)
+      putbuf((const char *)buf, want);
+    else
+      put = file_write(file, buf, want);
+    done += put;
+    if (put < want)
+      break;
+  }
+  free(buf);
+  return done;
+}
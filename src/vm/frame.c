@@ -190,10 +190,7 @@ bool all_pinned(void) {
 void write_file(struct frame_table_entry *fte) {
   struct file *file = fte->spte->file;
 
-  acquire_file_lock();
-  file_seek(file, fte->spte->offset);
-  file_write(file, fte->kaddr, PGSIZE);
-  release_file_lock();
+  file_write_at(file, fte->kaddr, PGSIZE, fte->spte->offset);
 
   pagedir_set_dirty(fte->owner->pagedir, fte->spte->uaddr, false);
 }
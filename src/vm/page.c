@@ -139,20 +139,16 @@ bool load_file(struct sup_page_table_entry *spte) {
     return false;
   }
 
-  acquire_file_lock();
-
-  file_seek(spte->file, spte->offset);
-  // read bytes from the file
-  int read = file_read(spte->file, spte->kaddr, spte->read_bytes);
+  // read bytes from the file, at an offset of their own, since
+  // eviction may write back another page of the same file
+  int read =
+      file_read_at(spte->file, spte->kaddr, spte->read_bytes, spte->offset);
   if (read != (int)spte->read_bytes) {
-    release_file_lock();
     lock_release(&spte->spte_lock);
     frame_free(spte->kaddr);
     return false;
   }
 
-  release_file_lock();
-
   // zero the rest
   memset(spte->kaddr + spte->read_bytes, 0, spte->zero_bytes);
   return true;
@@ -31,9 +31,8 @@ void swap_in(size_t swap_index, void *page) {
   lock_acquire(&swap_lock);
 
   /* Read data. */
-  for (size_t i = 0; i < SECTORS_PER_PAGE; i++)
-    block_read(swap_block, swap_index * SECTORS_PER_PAGE + i,
-               page + i * BLOCK_SECTOR_SIZE);
+  block_read_multiple(swap_block, swap_index * SECTORS_PER_PAGE,
+                      SECTORS_PER_PAGE, page);
 
   bitmap_set(swap_bitmap, swap_index, false);
 
@@ -48,9 +47,8 @@ size_t swap_out(void *page) {
   size_t swap_index = bitmap_scan_and_flip(swap_bitmap, 0, 1, false);
 
   /* Write data. */
-  for (size_t i = 0; i < SECTORS_PER_PAGE; i++)
-    block_write(swap_block, swap_index * SECTORS_PER_PAGE + i,
-                page + i * BLOCK_SECTOR_SIZE);
+  block_write_multiple(swap_block, swap_index * SECTORS_PER_PAGE,
+                       SECTORS_PER_PAGE, page);
 
   lock_release(&swap_lock);
 